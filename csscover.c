@@ -67,7 +67,7 @@ typedef struct
 sel;
 
 // Interface strings and arguments for [f]printf()
-#define USAGE_STRING	"Usage: csscover [-d] [-I=<importpath>] [-W[no-]<warning> [...]] <htmlfile> [...]"
+#define USAGE_STRING	"Usage: csscover [-d] [--cache=<dir>] [-I=<importpath>] [-W[no-]<warning> [...]] <htmlfile> [...]"
 
 #define PARSERR		"csscover: Error (Parser, state %d) at %d:%d, cstr '%s'\n"
 #define PARSARG		state, line+1, pos+1, cstr
@@ -118,6 +118,7 @@ int main(int argc, char *argv[])
 	bool wdupfile=true;
 	bool wvermismatch=true;
 	bool hide_child_msgs=false;
+	char *cachedir=NULL; // passed on to cssi
 	int arg;
 	for(arg=1;arg<argc;arg++)
 	{
@@ -214,6 +215,10 @@ int main(int argc, char *argv[])
 		{
 			sscanf(strchr(argt, '=')+1, "%d", &maxwarnings);
 		}
+		else if(strncmp(argt, "--cache=", 8)==0)
+		{
+			cachedir=argt;
+		}
 		else if(strncmp(argt, "-I=", 3)==0)
 		{
 			importpath=argt+3;
@@ -325,7 +330,7 @@ int main(int argc, char *argv[])
 		for(i=0;i<nels[file];i++)
 		{
 			if(trace)
-				fprintf(stderr, "%d:%s\n", html[file][i].tag, tags[html[file][i].tag]);
+				fprintf(stderr, "%d:%s\n", html[file][i].tag, tags[html[file][i].tag].name);
 			if(html[file][i].tag==TAG_LINK)
 			{
 				bool isss=false;
@@ -428,25 +433,33 @@ int main(int argc, char *argv[])
 					write(rp[1], "ERR:EDUP2\n", strlen("ERR:EDUP2\n"));
 					return(2);
 				}
-				char *eargv[trace?4:5+2*cfiles];
-				eargv[0]="cssi";
-				eargv[1]="-d";
-				eargv[2]="-Wall";
+				char *eargv[6+2*cfiles];
+				int neargv=0;
+				eargv[neargv++]="cssi";
+				eargv[neargv++]="-d";
+				eargv[neargv++]="-Wall";
 				if(trace)
 				{
-					eargv[3]="-t";
+					eargv[neargv++]="-t";
 					fprintf(stderr, "execvp(\"cssi\", {\"cssi\", \"-d\", \"-Wall\", \"-t\"");
 				}
+				if(cachedir)
+				{
+					eargv[neargv++]=cachedir;
+					if(trace)
+						fprintf(stderr, ", \"%s\"", cachedir);
+				}
 				int i;
 				for(i=0;i<cfiles;i++)
 				{
-					eargv[2*i+(trace?4:3)]=(char *)malloc(4+strlen(c_assoc_ipath[i]));
-					sprintf(eargv[2*i+(trace?4:3)], "-I=%s", c_assoc_ipath[i]);
-					eargv[2*i+(trace?5:4)]=cssfiles[i];
+					eargv[neargv]=(char *)malloc(4+strlen(c_assoc_ipath[i]));
+					sprintf(eargv[neargv], "-I=%s", c_assoc_ipath[i]);
+					eargv[neargv+1]=cssfiles[i];
 					if(trace)
-						fprintf(stderr, ", \"%s\", \"%s\"", eargv[2*i+(trace?4:3)], eargv[2*i+(trace?5:4)]);
+						fprintf(stderr, ", \"%s\", \"%s\"", eargv[neargv], eargv[neargv+1]);
+					neargv+=2;
 				}
-				eargv[(trace?4:3)+2*cfiles]=NULL;
+				eargv[neargv]=NULL;
 				if(trace)
 					fprintf(stderr, ", NULL})\n");
 				execvp("cssi", eargv);
@@ -983,23 +996,16 @@ ht_el * htparse(char ** lines, int nlines, int * nels)
 				case 3:
 					if(strchr(" \t\r\f\n>", *curr))
 					{
-						int i;
-						for(i=0;i<ntags;i++)
+						int i=cstr?tag_lookup(cstr, cstl, true):-1;
+						if(i>=0)
 						{
-							if(strcasecmp(cstr, tags[i])==0)
+							if((strcmp(cstr, tags[i].name)!=0) && wcase && (nwarnings++ < maxwarnings))
 							{
-								if((strcmp(cstr, tags[i])!=0) && wcase && (nwarnings++ < maxwarnings))
-								{
-									fprintf(output, PARSEWARN"\tUpper-case element names in HTML\n", PARSEWARG);
-									fprintf(output, PMKLINE);
-									if(daemonmode)
-										printf(DPARSEWARN"upper-case element names in HTML\n", DPARSEWARG);
-								}
-								break;
+								fprintf(output, PARSEWARN"\tUpper-case element names in HTML\n", PARSEWARG);
+								fprintf(output, PMKLINE);
+								if(daemonmode)
+									printf(DPARSEWARN"upper-case element names in HTML\n", DPARSEWARG);
 							}
-						}
-						if(i<ntags)
-						{
 							htop.tag=i;
 							if(*curr=='>')
 							{
@@ -1390,9 +1396,9 @@ ht_el * htparse(char ** lines, int nlines, int * nels)
 	}
 	if((parent!=-1) && wclose && (nwarnings++ < maxwarnings))
 	{
-		fprintf(output, PARSEWARN"\tElement not closed at EOF: %s\n", PARSEWARG, tags[rv[parent].tag]);
+		fprintf(output, PARSEWARN"\tElement not closed at EOF: %s\n", PARSEWARG, tags[rv[parent].tag].name);
 		if(daemonmode)
-			printf(DPARSEWARN"element not closed at EOF:\"%s\"\n", DPARSEWARG, tags[rv[parent].tag]);
+			printf(DPARSEWARN"element not closed at EOF:\"%s\"\n", DPARSEWARG, tags[rv[parent].tag].name);
 	}
 	return(rv);
 }
@@ -1430,7 +1436,7 @@ char *buildmatch(ht_el * file, int el)
 {
 	char *rv;
 	ht_el curr=file[el];
-	char *desc=strdup(tags[curr.tag]); // TODO [attr] when cssi supports it
+	char *desc=strdup(tags[curr.tag].name); // TODO [attr] when cssi supports it
 	int i;
 	for(i=0;i<curr.nattrs;i++)
 	{
@@ -23,29 +23,53 @@
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <stdatomic.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#if defined(NOSIMD) // -DNOSIMD: scan_special() a byte at a time, as make check compares the others with it
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "tags.h"
 
 // helper fn macros
 #define max(a,b)	((a)>(b)?(a):(b))
 #define min(a,b)	((a)<(b)?(a):(b))
+#define BITWORDS(n)	(((n)+63)/64) // words in a bitset of n
+#define BIT_TEST(b,i)	(((b)[(i)/64]>>((i)%64))&1)
 
 // Interface strings and arguments for [f]printf()
-#define USAGE_STRING	"Usage: cssi [-d][-t] [-I=<importpath>] [-W[no-]<warning> [...]] <filename> [...]"
+#define USAGE_STRING	"Usage: cssi [-d][-t] [-j=<jobs>] [--lazy|--background] [--watch] [--cache=<dir>] [--save-index=<file>] [-I=<importpath>] [-W[no-]<warning> [...]] <filename> [...]\n   or: cssi [-d] --index=<file>"
 
 #define PARSERR		"cssi: Error (Parser, state %d) at %d:%d\n"
-#define PARSARG		state, line+1, pos+1
+#define PARSARG		state, line+1, lcol(mf, line, off)+1
 
 #define PARSEWARN	"cssi: warning: (Parser, state %d) at %d:%d\n"
-#define PARSEWARG	state, line+1, pos+1
+#define PARSEWARG	state, line+1, lcol(mf, line, off)+1
 
 #define DPARSERR	"ERR:EPARSE:%d,%d.%d:"
-#define DPARSARG	state, line, pos /* note, this is 0-based */
+#define DPARSARG	state, line, lcol(mf, line, off) /* note, this is 0-based */
 
 #define DPARSEWARN	"WARN:WPARSE:%d,%d.%d:"
-#define DPARSEWARG	state, line, pos /* note, this is 0-based */
+#define DPARSEWARG	state, line, lcol(mf, line, off) /* note, this is 0-based */
 
-#define PMKLINE		"%.*s/* <- */%s\n", pos+1, mfile[line], mfile[line]+pos+1
+// the line index (see line_start()) only gets built when one of these is actually printed
+#define PMKLINE		"%.*s/* <- */%.*s\n", lcol(mf, line, off)+1, mf->buf+line_start(mf, line), max(llen(mf, line)-lcol(mf, line, off)-1, 0), mf->buf+off+1
 
 #define SPARSERR	"cssi: Error (Sel-Parser, state %d) row %d, col %d\n"
 #define SPARSARG	state, sid, pos+1
@@ -59,15 +83,35 @@
 #define DSPARSEWARN	"WARN:WSPARSE:%d,%d.%d:"
 #define DSPARSEWARG	state, sid, pos /* note, this is 0-based */
 
-#define SPMKLINE	"%.*s/* <- */%s\n", pos+1, s->text, s->text+pos+1
+#define SPMKLINE	"%.*s/* <- */%s\n", pos+1, text, text+min(pos+1, (int)strlen(text)) // an error can be at the very end
 
 // structs for representing CSS things
 
+typedef struct
+{
+	char * buf; // the file image; there is always a 0 after the last byte, but it's not counted in len
+	size_t len;
+	bool mapped; // true if buf is mmap()ed, false if it was malloc()ed
+	int nlines; // 0 until line_start() has built the index
+	size_t * lines; // offset of the start of each line
+	long long mtime, mtimens; // from fstat(), so the cache can tell if it's changed
+	atomic_int * refs; // how many css_sets share this image (and its entries' matches, which point into it); NULL if it isn't ours to free
+}
+css_file;
+
+typedef struct
+{
+	int file; // which image it points into (index into files[])
+	int off; // offset into that file's buf
+	int len;
+}
+span; // a piece of source text; comments and so on are only taken out when it's printed, see spantext()
+
 typedef struct
 {
 	int nmatches;
-	char ** matches; // the selectors
-	char * innercode; // what's between the braces (not that we intend to parse this yet)
+	span * matches; // the selectors
+	span innercode; // what's between the braces (not that we intend to parse this yet)
 	signed int file; // which file is it in? (0-based); -1 means 'not yet filled in'
 	signed int line; // line number on which the selector appears (0-based!!!); -1 means 'not yet filled in'
 	int numlines; // how far to the closing brace? (0==closing brace is on same line as selector)
@@ -95,60 +139,519 @@ typedef enum
 }
 seltype;
 
-typedef struct _sel_elt3 // selfing
+typedef unsigned long long bitword; // query results are bitsets of SelIds, 64 to a word
+
+typedef unsigned int atom; // index into the intern table; identifiers are compared by atom, not by strcmp
+#define ATOM_NONE	0 // no such string (UNIV, or a match= name that no stylesheet uses)
+#define ATOM_ANY	1 // "?", the wildcard name; any match= name beginning with '?' becomes this
+#define ATOM_FIRSTCHILD	2 // "firstchild", which tree_match has to look for
+
+// A parsed selector is a sel_chain: one block holding the header and then three arrays, which refer to each other by index
+typedef struct // selfing
 {
 	seltype type;
-	char * data; // eg "#foo" becomes type=ID, data="foo"; "[bar]" becomes type=ATTR, data="bar".
-	struct _sel_elt3 * next; // linked-list
+	atom name; // eg "#foo" becomes type=ID, name=intern("foo"); "[bar]" becomes type=ATTR, name=intern("bar").
 }
 sel_elt3;
 
-typedef struct _sel_elt2 // sibling
+typedef struct // sibling; the relation to the next one is always SBLG (or Generalised sibling, when we implement that (~); only SBLG in a match - will need to enforce when implemented)
 {
-	sel_elt3 * selfs; // Should never be NULL
-	family nextrel; // should be SBLG (or Generalised sibling, when we implement that (~); only SBLG in a match - will need to enforce when implemented)
-	struct _sel_elt2 * next; // linked-list
-	struct _sel_elt2 * prev; // doubly!
+	unsigned int selfs; // index of its first sel_elt3
+	unsigned int nselfs; // Should never be 0
 }
 sel_elt2;
 
-typedef struct _sel_elt // childing/descing
+typedef struct // childing/descing
 {
-	sel_elt2 * sibs; // NULL means "*"
-	sel_elt2 * last; // the last sibling (ie. the one we actually match into)
+	unsigned int sibs; // index of its first sel_elt2
+	unsigned int nsibs; // 0 means "*"; the last sibling is the one we actually match into
 	family nextrel; // should be CHLD or DESC (only CHLD in a match)
-	struct _sel_elt * next; // linked-list
-	struct _sel_elt * prev; // doubly!
 }
 sel_elt;
 
 typedef struct
 {
-	char * text; // when we parse this
-	sel_elt * chain; // it goes here
+	unsigned int size; // of the whole block, in bytes
+	unsigned int nelts; // 0 means "*"
+	unsigned int nsibs;
+	unsigned int nselfs;
+	unsigned long long fp; // structural fingerprint, from chain_fp(); equal chains have equal fps
+	// followed by sel_elt3[nselfs], sel_elt2[nsibs], sel_elt[nelts]
+}
+sel_chain;
+
+#define CH_SELFS(c)	((sel_elt3 *)((c)+1))
+#define CH_SIBS(c)	((sel_elt2 *)(CH_SELFS(c)+(c)->nselfs))
+#define CH_ELTS(c)	((sel_elt *)(CH_SIBS(c)+(c)->nsibs))
+
+#define RULE_UNIV	0 // rule_key()s: the rightmost compound has no id, class or tag
+#define RULE_ID(a)	(1+(a)) // then one for each atom of each, ids first
+#define RULE_CLASS(a, n)	(1+(n)+(a)) // (n is natoms)
+#define RULE_TAG(a, n)	(1+2*(n)+(a))
+#define RULE_KEYS(n)	(1+3*(n))
+
+#define ANC_ID	0x000000000000ffffull // the parts of an anc_mask(): 16 bits for ids, 16 for tags, and 32 for classes, pclasses and attributes
+#define ANC_TAG	0x00000000ffff0000ull
+#define ANC_OTHER	0xffffffff00000000ull
+
+#define KEY_END_SIBS	0 // words in a selkey(); these two sort before any self, which is 2+type
+#define KEY_END_SELFS	1
+
+typedef struct _arena_blk
+{
+	struct _arena_blk * next;
+	size_t used;
+	size_t size;
+	char data[];
+}
+arena_blk;
+
+typedef struct
+{
+	arena_blk * head; // the block we're allocating from; older blocks hang off its next
+}
+arena; // bump allocator; everything in it is freed at once by arena_free()
+
+typedef struct
+{
+	span text; // when we parse this
+	sel_chain * chain; // it goes here; NULL if it didn't parse
 	int ent; // index into entries table
 	int dup; // 0=no duplicates, NZ num=first sel of dup block
-	bool lmatch; // was it matched by the last test() run?
+	int group; // index (in the array given to dup_groups(), which is the sorted one) of the first selector with the same chain
 }
 selector;
 
+typedef struct
+{
+	char * text;
+	bool tostdout; // else it goes to output
+	int warn; // 0, or which of its job's warnings it's part of
+}
+jmsg;
+
+typedef enum
+{
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE
+}
+jobstate;
+
+typedef enum // how far a --background collation has got
+{
+	COLL_FAILED=-1, // it has said why
+	COLL_RUNNING,
+	COLL_SORTED, // sort[] can be listed, but the dups aren't marked yet
+	COLL_DONE
+}
+collstage;
+
+typedef struct // a file's entry in the --cache= directory
+{
+	char * path; // NULL if we aren't caching it
+	bool hit; // its parse came from there, and blob holds the saved chains
+	bool bad; // ran out of memory building blob, so don't write it
+	char * blob; // else, what parse_file() saved, for main() to add the chains to and write out
+	size_t len, cap;
+	int sel0, nsel; // its selectors, in sels[]
+}
+file_cache;
+
+#define CACHE_MAGIC	"cssic\0\0\1"
+#define FNV64_BASIS	14695981039346656037ull
+
+typedef struct // the start of a cache file; then come the msgs, entries and imports, then the chains (from cache_write())
+{
+	char magic[8];
+	unsigned long long size, hash; // of the CSS file; hash is FNV-1a of its contents, checked if the mtime doesn't match
+	long long mtime, mtimens;
+	unsigned int nmsgs, nwarn, nentries, nimports;
+}
+cache_hdr;
+
+#define INDEX_MAGIC	"cssix\0\0\1"
+
+typedef struct // the start of an --index= file; everything else in it is found by the offsets here, so it can be used straight from the mmap()
+{
+	char magic[8];
+	unsigned int sizes[6]; // of the structs below, so one from an incompatible build is refused
+	unsigned int nfiles, nentries, nsels, natoms, atomhsize, nerrs;
+	unsigned long long files; // index_file[nfiles]
+	unsigned long long entries; // entry[nentries], with matches=NULL (the selectors are in sels)
+	unsigned long long sels; // index_sel[nsels], in sorted order
+	unsigned long long atoms; // unsigned long long[natoms], the offset of each atom's string (0 for atoms[0])
+	unsigned long long atomhash; // unsigned int[atomhsize], as intern() left it
+	unsigned long long atomrank; // unsigned int[natoms]
+}
+index_hdr;
+
+typedef struct
+{
+	unsigned long long name; // offset of the filename
+	unsigned long long buf; // offset of the image, which has a 0 after it (or 0 if it has none, eg. a dup)
+	unsigned long long len;
+}
+index_file;
+
+typedef struct
+{
+	span text;
+	int ent, dup, group;
+	unsigned long long chain; // offset of its sel_chain, or 0 if it didn't parse
+}
+index_sel;
+
+typedef struct // one file to be parsed, by a worker thread or by main()
+{
+	int i; // index into filename[]
+	char * name;
+	char * ipath;
+	bool wnewline, watrule;
+	int dupof; // -1, or the earlier index of the same file (which means it's skipped)
+	css_file file;
+	entry * entries;
+	int nentries;
+	char ** imports; // @imported files, in the order they were found
+	int nimports;
+	jmsg * msgs; // everything it would have printed, to be replayed in file order
+	int nmsgs;
+	int nwarn; // how many warnings it has started
+	int rv; // 0, or main()'s return code if it failed
+	jobstate state; // protected by jobmutex
+	css_file * mf; // for a chunk: its file's image, and the part of it to parse
+	size_t start, end;
+	int line0;
+	int qidx; // index in chunkq[] (or prefq[], for a prefetch)
+	bool prefetched; // started before main() queued it; its name is its own copy
+	file_cache cache;
+}
+parse_job;
+
+typedef struct // a range of selectors for one thread to parse, in parse_sels()
+{
+	selector * sels;
+	int lo, hi;
+	bool * fresh; // which of sels[] it parsed (rather than got from the cache), so main() knows whose atoms they use
+	bool threaded; // it has a thread (and so an intern table) of its own
+	css_file * files; // its caller's, for spantext()
+	int nerrs;
+	parse_job msgs; // what it would have printed; only its msgs are used
+	arena chains;
+	char ** atoms; // its thread's intern table, to be mapped into main()'s
+	unsigned int natoms;
+	unsigned int * atomhash;
+	arena atomarena;
+}
+sel_task;
+
+typedef struct // a --background collation, and what it makes; main() waits for stage before it looks at the rest
+{
+	entry * entries;
+	int nentries;
+	file_cache * fcache;
+	css_file * files;
+	int nfiles;
+	selector * sort;
+	int nsels, nerrs;
+	collstage stage; // protected by jobmutex
+	char ** atoms; // its thread's intern table, for main() to adopt
+	unsigned int natoms;
+	unsigned int * atomhash;
+	unsigned int atomhsize;
+	unsigned int * atomrank;
+	arena atomarena;
+}
+bg_collation;
+
+typedef struct // the stylesheets, and everything the shell answers from; with --watch, a snapshot that stays as it is while anyone has a reference to it (see snap_get())
+{
+	char ** filename; // by file index, like files[]; the first ninit are from the command line, the rest were @imported
+	char ** ipath; // the importpath each was given
+	int nfiles, ninit;
+	int * importer; // the file that @imported each, or -1; so a reload can tell if a file's @imports have changed
+	file_cache * fcache;
+	entry * entries; // in file order
+	int nentries;
+	selector * sort;
+	int nsels, nerrs;
+	bool collated, dupsmarked; // with --lazy (or --background), these wait for the first query that needs them
+	css_file * files; // the images its spans point into
+	bitword * lmatch; // the SelIds the last test() picked.  Only the shell touches this, so a reload starts it afresh
+	int * byline; // SelIds in (file, line) order, by snap_index(); each file's run of it is that file's postings list
+	int * fileoff; // by file index: where its run in byline[] starts (fileoff[nfiles] is nsels)
+	int * dupsels; // SelIds that have a dup, in order; their dup values never go down, so a range of them can be bisected
+	int ndupsels;
+	int * byrule; // SelIds bucketed by rule_key(), so a match= tree need only test the buckets its own rightmost compound could match
+	int * ruleoff; // by key: where its bucket starts in byrule[] (ruleoff[RULE_KEYS(natoms)] is nsels)
+	bitword * ancmask; // by SelId, the anc_mask() of its chain
+	char ** atoms; // the intern table its chains use; a reload adds to a copy (the strings themselves are never freed)
+	unsigned int natoms;
+	unsigned int * atomhash;
+	unsigned int atomhsize;
+	unsigned int * atomrank; // by rank_atoms(); a reload ranks its copy's again
+	atomic_int refs; // current's, and the shell's while it answers a command; the last snap_put() frees it
+}
+css_set;
+
+typedef enum // what a query parameter looks at
+{
+	QF_SID,
+	QF_FILE,
+	QF_LINE,
+	QF_DUP,
+	QF_LAST,
+	QF_MATCH
+}
+qfield;
+
+typedef enum
+{
+	QOP_NZ, // no comparator
+	QOP_EQ,
+	QOP_LT,
+	QOP_LE,
+	QOP_GT,
+	QOP_GE
+}
+qop;
+
+typedef struct // tree_match()'s answers for one selector, so with a prepension limit each subproblem is only worked out once (see tree_match_real())
+{
+	unsigned char * val; // by (curr, match+1, prep): 0 if not known yet, else 1+the answer
+	size_t size; // allocated, in bytes
+	int nm, np; // the ranges of match+1 and prep
+}
+tm_memo;
+
+typedef struct // one parameter of a query, as plan_query() compiled it
+{
+	qfield field;
+	qop op;
+	bool neg;
+	int val;
+	bool * files; // QF_FILE: by file index, whether it passes (neg included), so the names are compared once per file rather than per selector
+	sel_chain * tree; // QF_MATCH
+	int prep;
+	bitword anc; // QF_MATCH with no prepension: a selector whose ancmask[] has any of these bits can't match (see anc_care())
+	tm_memo memo; // QF_MATCH
+}
+qterm;
+
+typedef struct // a compiled query: the selectors in [lo,hi) that pass every term, up to nrows of them
+{
+	qterm * terms; // the cheap ones first, then the match= trees
+	int nterms;
+	int lo, hi; // from the sid terms
+	int nrows;
+	bool none; // some term can't pass at all
+	bool * files; // from a file= term that isn't negated, the files a match can be in (NULL if there's none); test() starts from their runs of byline[]
+	long long linelo, linehi; // from the line terms that aren't negated, the (0-based) lines a match can be on
+	long long duplo, duphi; // the same for dup; if duplo>0, test() can start from dupsels[]
+	arena scratch; // the match= trees
+}
+qplan;
+
+typedef struct // the keys and buffers of a selsort(), and one block of it for a thread to sort
+{
+	unsigned int * keys, * koff, * klen;
+	unsigned long long * kpre;
+	int * idx, * tmp;
+	int lo, hi, width; // sort_block() sorts [lo,hi) into runs of width
+}
+sort_ctx;
+
+typedef struct // walks a selkey() a word at a time, without writing it out; see key_next()
+{
+	sel_chain * c;
+	unsigned int e, s, f, step;
+}
+key_cursor;
+
+typedef struct // a file in the import graph; found by identity, so the same file under two names is still a dup
+{
+	char * name;
+	dev_t dev;
+	ino_t ino; // dev and ino are 0 if it couldn't be stat()ed (or is stdin), and then only the name identifies it
+	int idx; // index in filename[], or -1 if it has only been prefetched so far
+	parse_job * job; // the prefetch, until main() adopts it
+}
+file_node;
+
+#define CHUNK_MIN	262144 // smaller files aren't worth splitting
+#define SELS_MIN	16384 // nor are fewer selectors than this (per thread), when collating
+#define WATCH_SETTLE	100 // ms without another change before --watch reloads; saving a file is often several events
+
+#ifndef _WIN32
+#define THREAD_LOCAL	_Thread_local
+#else
+#define THREAD_LOCAL
+#endif
+
+#if defined(__APPLE__)
+#define ST_MTIME_NS(st)	((st).st_mtimespec.tv_nsec)
+#elif defined(_WIN32)
+#define ST_MTIME_NS(st)	0
+#else
+#define ST_MTIME_NS(st)	((st).st_mtim.tv_nsec)
+#endif
+
+#ifndef _WIN32
+#define JOB_LOCK()	pthread_mutex_lock(&jobmutex)
+#define JOB_UNLOCK()	pthread_mutex_unlock(&jobmutex)
+#define JOB_WAIT()	pthread_cond_wait(&jobcond, &jobmutex)
+#define JOB_SIGNAL()	pthread_cond_broadcast(&jobcond)
+#define OUT_LOCK()	flockfile(stdout) // so a --background collation can't print in the middle of a listing
+#define OUT_UNLOCK()	funlockfile(stdout)
+#else // no threads; main() parses everything itself, so it never has to wait
+#define JOB_LOCK()
+#define JOB_UNLOCK()
+#define JOB_WAIT()
+#define JOB_SIGNAL()
+#define OUT_LOCK()
+#define OUT_UNLOCK()
+#endif
+
 // function protos
-char * fgetl(FILE *); // gets a line of string data; returns a malloc-like pointer (preserves trailing \n)
-char * getl(char *); // like fgetl(stdin) but prints a prompt too (strips trailing \n)
-selector * selmergesort(selector * array, int len);
-int parse_selector(selector *, int);
-void tree_free(sel_elt * node);
-int treecmp(sel_elt * left, sel_elt * right);
-bool * test(int parmc, char *parmv[], selector * sort, entry * entries, char ** filename, int nsels);
-bool tree_match(sel_elt * curr, sel_elt * match, int prep);
-bool tree_match_real(sel_elt *curr, sel_elt *match, int prep);
-bool tree_match_3(sel_elt3 *selfs, sel_elt3 *melfs);
-bool has_firstchild(sel_elt3 *melfs);
+int load_file(char * name, css_file * f); // reads the whole file into f; returns 0 on success, 1 if it couldn't be read, 2 on out-of-memory
+void unload_file(css_file * f);
+size_t line_start(css_file * f, int line); // offset of the start of line (0-based)
+int lcol(css_file * f, int line, size_t off); // column of off, which must lie on line
+int llen(css_file * f, int line); // length of line, including its '\n'
+int spantext(span s, char * buf, FILE * fp, bool sel); // normalises s into buf (if not NULL; must have room for s.len+1) or else onto fp; returns the length
+char * getl(char *); // gets a line from stdin but prints a prompt too (strips trailing \n)
+selector * selsort(selector * array, int len); // returns a sorted copy, or NULL on out-of-memory
+void * sort_block(void * arg); // sorts one sort_ctx block; selsort() gives each thread one, and merges them itself
+void merge_pass(sort_ctx * c, int * from, int * to, int w, int lo, int hi); // merges the runs of w in [lo,hi) of from into runs of 2w in to
+unsigned int selkey(sel_chain * c, unsigned int * key);
+unsigned int key_next(key_cursor * kc); // the next word of kc->c's selkey(); kc must start zeroed, and mustn't be asked for more words than the key has
+int parse_selector(selector *, char *, int, arena *, parse_job *); // sid<0 means a match= tree, which doesn't add to the intern table; messages are saved up in the parse_job, if it's not NULL
+int parse_selector_real(selector * s, char * text, int sid, arena * a, parse_job * j, sel_elt * elts, sel_elt2 * sibs, sel_elt3 * selfs, char * name); // parse_selector(), given scratch space for the whole of text
+int collate(entry * entries, int nentries, file_cache * fcache, int nfiles, selector ** sort, int * nsels, int * nerrs); // parses and sorts the selectors; returns 0 on success, 1 on out-of-memory (having said so)
+int parse_sels(selector * sels, int nsels); // parses every selector that hasn't a chain, with up to nthreads threads; returns the number of errors, or -1 on out-of-memory
+void * parse_sel_range(void * arg); // a sel_task's thread
+int mark_dups(selector * sort, int nsels); // sets each sort[i].dup; returns 0 on success, 1 on out-of-memory (having said so)
+bool needs_dups(int parmc, char *parmv[]); // does a query use the dup values?
+int need_collation(css_set * s, bool dups); // collates s if it isn't already (or waits for the --background collation), and marks the dups too if asked; returns 0, or 1 if it failed (having said so)
+int parse_set(css_set * s); // parses s's files and their @imports; returns 0, or main()'s return code
+void replay_msgs(parse_job * j, int * nwarnings); // prints what j saved up, counting its warnings against maxwarnings
+void discard_job(parse_job * j); // frees j and everything it found
+int reload_file(css_set * s, int i, int * nwarnings); // reparses file i and puts what it found in place of what it had, in a snap_copy() this thread is using; returns 0, 1 if its @imports changed (so it wasn't), 2 if it couldn't be parsed (so s is as it was), or -1 on out-of-memory (having said so)
+css_set * reparse_set(css_set * s); // starts again from s's command-line files, and collates them; returns the new set, or NULL if that failed (having said why)
+int selcmp(selector * a, selector * b); // the order selsort() puts them in; equal keys go in file order
+void watch_files(css_set * s); // (re)starts watching each file's directory
+void * watch_thread(void * arg); // reloads whatever changes, and publishes the result; it never returns
+css_set * snap_get(void); // takes a reference to current; never waits
+void snap_put(css_set * s); // drops one, freeing s if it was the last
+void snap_use(css_set * s); // points this thread's files[] and intern table at s's
+int snap_index(css_set * s); // builds s's secondary indexes (the dup table once its dups are marked), if it hasn't them already; returns 0, or 1 on out-of-memory (having said so)
+int snap_collated(css_set * s); // this thread has just collated s, so s takes its intern table (which that added to) and gets an lmatch[]; returns 0, or 1 on out-of-memory (having said so)
+void snap_publish(css_set * s); // makes s current, and lets go of the old one once no snap_get() can still be taking it
+css_set * snap_copy(css_set * s); // a copy of s for a reload to change, sharing its images; NULL on out-of-memory
+void snap_free(css_set * s);
+void file_put(css_file * f, entry * ents, int nents); // drops a reference to f; if it was the last, frees f and the matches of ents (its entries)
+void say_collated(int nerrs); // COLL*, once the dups are marked too (or with --lazy, once sort[] is ready)
+bool start_collation(bg_collation * b); // collates on a thread of its own; false if there isn't one to be had
+void * collate_bg(void * arg); // start_collation()'s thread
+int wait_collation(bg_collation * b, collstage stage); // waits till b gets to stage, then adopts its intern table; returns 0, or 1 if it failed
+atom intern(const char * str, size_t len, bool add); // returns ATOM_NONE if str isn't there and !add
+void rank_atoms(void); // sorts the intern table, so treecmp can order atoms as strcmp would
+int atomcmp(const void * a, const void * b);
+void * arena_alloc(arena * a, size_t size); // returns NULL on out-of-memory
+void arena_free(arena * a);
+int selfcmp(const sel_elt3 * left, const sel_elt3 * right); // canonical order of the selfs in a compound: by type, then name
+int treecmp(sel_chain * left, sel_chain * right); // a total order, but not the listing order (that's selkey()'s); differing fps are decided without walking the chains
+unsigned long long chain_fp(sel_chain * c); // hashes the names' strings, not their atoms, so it doesn't depend on the order they were interned in
+int dup_groups(selector * sels, int nsels); // sets each sels[i].group; returns 0 on success, 1 on out-of-memory
+void parse_file(parse_job * j); // loads and parses j's file, in chunks if it's big; it only touches j and its own file
+void parse_range(parse_job * j, css_file * mf, size_t off, size_t end, int line); // the CSS parser proper
+int find_chunks(css_file * mf, size_t target, size_t * cuts, int * cutlines, int maxchunks); // finds places mf can be split so that each piece parses alone; returns the number of pieces, and cuts[that] is mf->len
+void parse_chunks(parse_job * j, css_file * mf, size_t * cuts, int * cutlines, int nchunks);
+char * scan_special(char * p, char * end, char a, char b, char c, int * lines); // returns the first of a, b or c at or after p (or end), adding the '\n's it passed to *lines
+parse_job * queue_file(int i, char ** filename, char * ipath, bool wnewline, bool watrule);
+void prefetch_file(parse_job * parent, char * name); // starts parsing an @imported file before main() gets to it
+void file_id(file_node * n); // fills in n->dev, n->ino from n->name
+int file_find(file_node * key); // returns the index in fnodes[], or -1; jobmutex must be held
+int file_add(file_node * key); // the same, after adding it (or -1 on out-of-memory)
+unsigned long long fnv64(const void * p, size_t len, unsigned long long h); // FNV-1a; start h at FNV64_BASIS
+char * cache_path(parse_job * j); // where j's file is cached, or NULL if it can't be
+bool cache_load(parse_job * j, css_file * mf); // fills in j from the cache and returns true, if it's there and up to date
+void cache_save(parse_job * j, css_file * mf); // (after a parse) saves j's results into j->cache.blob
+void cache_chains(file_cache * fc, selector * sels, arena * a); // sets the chains of a hit's selectors; any it can't are left NULL, to be parsed
+bool chain_valid(sel_chain * c, size_t size); // does a chain read back from a cache or an index hang together?  (size is what it was said to take up; its names aren't checked)
+void cache_write(file_cache * fc, selector * sels); // adds the chains to fc->blob and writes it out
+void cput(file_cache * fc, const void * src, size_t len);
+bool cget(char ** p, char * end, void * dst, size_t len); // false if there isn't len left
+int save_index(char * path, char ** filename, int nfiles, entry * entries, int nentries, selector * sort, int nsels, int nerrs); // returns 0 on success, else errno
+int load_index(char * path, char *** filename, int * nfiles, entry ** entries, int * nentries, selector ** sort, int * nsels, int * nerrs); // returns 0 on success, 1 if it couldn't be read, 2 on out-of-memory, 3 if it isn't an index (or not one we can use)
+void * parse_worker(void * arg);
+void jvprintf(parse_job * j, FILE * fp, int warn, const char * fmt, va_list ap);
+void jprintf(parse_job * j, FILE * fp, const char * fmt, ...); // like fprintf(fp, ...), but saved up in j (if it's not NULL); fp must be output, stdout or stderr
+void jwprintf(parse_job * j, FILE * fp, const char * fmt, ...); // the same, for part of the warning started by the last jwarn()
+bool jwarn(parse_job * j); // starts a warning; whether it's shown depends on maxwarnings and the files before, so that's decided when it's replayed
+bitword * test(int parmc, char *parmv[], css_set * s); // the SelIds the query picks (and s->lmatch gets the same); NULL if it was bad (having said why)
+int bits_next(bitword * b, int i, int n); // the first set bit at or after i, or n if there's none before it
+int plan_query(qplan * q, int parmc, char *parmv[], css_set * s); // returns 0, or 1 if a parameter was bad (having said why)
+bool run_term(qterm * t, css_set * s, int i); // does sort[i] pass t?  (not for QF_LAST, which test() does a word at a time)
+bool term_cmp(qterm * t, int n); // does a value of n pass t's comparison?
+void term_bounds(qterm * t, long long * lo, long long * hi); // narrows [lo,hi] to the values that can pass t (which isn't negated)
+bitword * index_cands(qplan * q, css_set * s); // the SelIds the plan's file, dup or match= terms allow, from s's indexes; NULL if none of them can be used (or on out-of-memory)
+unsigned int rule_key(sel_chain * c, unsigned int n); // the bucket for a selector: by the id, else the class, else the tag of its rightmost compound (n is natoms)
+bitword anc_bit(sel_elt3 * f); // the bit for an id, tag, class, pclass or attribute in an anc_mask(); 0 for anything else
+bitword anc_mask(sel_chain * c); // a Bloom filter of the names in the rightmost compounds of c's ancestor elements (up to any '*'), each of which a match with no prepension must have
+bitword anc_care(sel_chain * m); // the bits an anc_mask() mustn't have to match m without prepension: those of the names m's ancestors lack, in the parts they don't match optimistically
+bool rule_cands(sel_chain * m, css_set * s, bitword * c); // sets the bits of the buckets a match= tree's rightmost compound could match; false (and sets none) if that's all of them
+void free_plan(qplan * q);
+bool tree_match(sel_chain * curr, sel_chain * match, int prep, tm_memo * memo); // memo may be NULL
+bool tree_match_real(sel_chain * c, int curr, sel_chain * m, int match, int prep, tm_memo * memo); // curr, match are indices into the chains' elts; match=-1 means we're prepending
+bool tree_match_elt(sel_chain * c, int curr, sel_chain * m, int match, int prep, tm_memo * memo); // tree_match_real() without the memo
+bool tree_match_3(sel_elt3 *selfs, int nselfs, sel_elt3 *melfs, int nmelfs);
+bool has_firstchild(sel_elt3 *melfs, int nmelfs);
 
 // global vars
 FILE *output;
 bool daemonmode=false; // are we talking to another process? -d to set
 bool trace=false; // for debugging, trace the parser's state and position
+char * cachedir=NULL; // --cache=<dir>; NULL means don't cache
+bool lazy=false; // --lazy: don't collate until a query needs it
+bool wnewline=true; // -W[no-]<warning>
+bool wdupfile=true;
+bool watrule=true;
+int maxwarnings=10; // -w
+bool watch=false; // --watch: reload the files when they change
+int watchfd=-1; // the inotify instance, if we're watching
+int * watchwd=NULL; // by file index: the watch on its directory, or -1; only the watcher thread uses these
+bool background=false; // --background: collate on another thread, while the shell takes commands
+bg_collation bgcoll; // not on main()'s stack, since the thread may outlive it
+THREAD_LOCAL css_file * files=NULL; // images of the files in filename[], which the spans point into; each thread reads those of its own css_set
+_Atomic(css_set *) current=NULL; // what the shell answers from; a reload builds a new one and swaps it in, see snap_publish()
+atomic_int snapgetting=0; // how many snap_get()s are between loading current and counting themselves in its refs
+THREAD_LOCAL char ** atoms=NULL; // the intern table; atoms[0] is NULL.  Each thread has its own, so selectors can be parsed at once; see parse_sels()
+THREAD_LOCAL unsigned int * atomrank=NULL; // position of each atom in strcmp order, set by rank_atoms(); part of the intern table, so it goes with the rest
+THREAD_LOCAL unsigned int natoms=0;
+THREAD_LOCAL unsigned int * atomhash=NULL; // open-addressed, holds atom numbers (0 means empty)
+THREAD_LOCAL unsigned int atomhsize=0; // always a power of 2
+THREAD_LOCAL arena atomarena={NULL}; // holds the strings in atoms[]
+THREAD_LOCAL css_set * atomset=NULL; // the set whose intern table the ones above are, since snap_use() or snap_collated(); if this thread has grown it, only they know where it is now
+parse_job ** jobs=NULL; // by file index; the array is protected by jobmutex
+int njobs=0;
+int nexttake=0; // next job for a worker to take
+bool jobsdone=false; // tells the workers to exit
+parse_job ** chunkq=NULL; // chunks of big files, for the workers to take before whole files; protected by jobmutex
+int nchunkq=0;
+int nextchunk=0;
+parse_job ** prefq=NULL; // @imported files found by the workers, to parse while there's nothing more pressing; protected by jobmutex
+int nprefq=0;
+int nextpref=0;
+file_node * fnodes=NULL; // every file seen, queued or prefetched; protected by jobmutex
+int nfnodes=0;
+int * fnhash=NULL; // open-addressed, holds fnodes[] index+1 (0 means empty)
+unsigned int fnhsize=0; // always a power of 2
+int nthreads=1; // how many files (or chunks) to parse at once
+#ifndef _WIN32
+pthread_mutex_t jobmutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t jobcond=PTHREAD_COND_INITIALIZER; // signalled when a job is queued or finished, or when it's time to stop
+#endif
 
 int main(int argc, char *argv[])
 {
@@ -159,10 +662,10 @@ int main(int argc, char *argv[])
 	char ** filename=NULL; // files to load
 	char *importpath="";
 	char ** assoc_ipath=NULL;
-	bool wnewline=true;
-	bool wdupfile=true;
-	bool watrule=true;
-	int maxwarnings=10;
+	char *saveindex=NULL, *indexfile=NULL;
+#ifndef _WIN32
+	nthreads=max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+#endif
 	int arg;
 	for(arg=1;arg<argc;arg++)
 	{
@@ -230,10 +733,40 @@ int main(int argc, char *argv[])
 				importpath=p; // technically this leads to a memory leak, since importpath never gets free()d - but since you're not likely to give more than a few -I= options, it shouldn't matter
 			}
 		}
+		else if((strncmp(argt, "-j=", 3)==0)||(strncmp(argt, "--jobs=", 7)==0))
+		{
+#ifndef _WIN32
+			sscanf(strchr(argt, '=')+1, "%d", &nthreads);
+#endif
+		}
 		else if((strncmp(argt, "-w=", 3)==0)||(strncmp(argt, "--max-warn=", 11)==0))
 		{
 			sscanf(strchr(argt, '=')+1, "%d", &maxwarnings);
 		}
+		else if(strncmp(argt, "--cache=", 8)==0)
+		{
+			cachedir=argt+8;
+		}
+		else if(strcmp(argt, "--lazy")==0)
+		{
+			lazy=true;
+		}
+		else if(strcmp(argt, "--background")==0)
+		{
+			background=true;
+		}
+		else if(strcmp(argt, "--watch")==0)
+		{
+			watch=true;
+		}
+		else if(strncmp(argt, "--save-index=", 13)==0)
+		{
+			saveindex=argt+13;
+		}
+		else if(strncmp(argt, "--index=", 8)==0)
+		{
+			indexfile=argt+8;
+		}
 		else
 		{
 			// assume it's a filename
@@ -244,375 +777,373 @@ int main(int argc, char *argv[])
 			assoc_ipath[nfiles-1]=importpath;
 		}
 	}
-	if(filename==NULL)
+	if(indexfile && filename)
+	{
+		fprintf(output, "cssi: Error: --index= doesn't take any files to go with it\n"USAGE_STRING"\n");
+		if(daemonmode)
+			printf("ERR:EBADARGS\n");
+		return(1);
+	}
+	if(indexfile && watch)
+	{
+		fprintf(output, "cssi: Error: --watch needs the files themselves, not an --index=\n"USAGE_STRING"\n");
+		if(daemonmode)
+			printf("ERR:EBADARGS\n");
+		return(1);
+	}
+	if((filename==NULL) && !indexfile)
 	{
 		fprintf(output, "cssi: Error: No file given on command line!\n"USAGE_STRING"\n");
 		if(daemonmode)
 			printf("ERR:ENOFILE\n");
 		return(1);
 	}
-	int i;
-	int nwarnings=0;
-	int nentries=0;
-	int initnfiles=nfiles; // initial nfiles, so we know if we've been @imported
-	entry * entries=NULL;
-	for(i=0;i<nfiles;i++)
+	int i, errupt=0;
+	css_set *set=(css_set *)calloc(1, sizeof(css_set)); // not on the stack, as with --watch it's freed once a reload replaces it
+	if(!set)
 	{
-		FILE *fp=NULL;
-		int j;
-		for(j=0;j<i;j++)
-		{
-			if(strcmp(filename[i], filename[j])==0)
-			{
-				if(wdupfile && (nwarnings++<maxwarnings))
-				{
-					fprintf(output, "cssi: warning: Duplicate file in set%s: %s\n", i<initnfiles?"":" (from @import)", filename[i]);
-					if(daemonmode)
-						printf("WARN:WDUPFILE:%d:\"%s\"\n", i<initnfiles?0:1, filename[i]);
-				}
-				goto skip; // there is *nothing* *wrong* with the occasional goto
-			}
-		}
-		if(strcmp(filename[i], "-")==0)
-			fp=stdin;
-		else
-			fp=fopen(filename[i], "r");
-		if(!fp)
-		{
-			fprintf(output, "cssi: Error: Failed to open %s for reading!\n", filename[i]);
-			if(daemonmode)
-				printf("ERR:ECANTREAD:\"%s\"\n", filename[i]);
-			return(1);
-		}
-		char ** mfile=NULL;
-		int nlines=0;
-		while(!feof(fp))
+		fprintf(output, "cssi: Error: Failed to alloc mem for the file set.\n");
+		if(daemonmode)
+			printf("ERR:EMEM\n");
+		return(1);
+	}
+	*set=(css_set){.filename=filename, .ipath=assoc_ipath, .nfiles=nfiles, .ninit=nfiles};
+	atomic_init(&set->refs, 1);
+	atomic_store(&current, set);
+	if(indexfile) // it's all been done already, and saved; so we can go straight to the shell
+	{
+		switch(load_index(indexfile, &set->filename, &set->nfiles, &set->entries, &set->nentries, &set->sort, &set->nsels, &set->nerrs))
 		{
-			nlines++;
-			mfile=(char **)realloc(mfile, nlines*sizeof(char *));
-			if(!mfile)
-			{
-				fprintf(output, "cssi: Error: Failed to alloc mem for input file.\n");
-				perror("malloc/realloc");
+			case 0:
+			break;
+			case 2:
+				fprintf(output, "cssi: Error: Failed to alloc mem for index.\n");
 				if(daemonmode)
 					printf("ERR:EMEM\n");
 				return(1);
-			}
-			mfile[nlines-1]=fgetl(fp);
-			if(!mfile[nlines-1])
-			{
-				fprintf(output, "cssi: Error: Failed to alloc mem for input file.\n");
-				perror("malloc/realloc");
+			break;
+			case 3:
+				fprintf(output, "cssi: Error: %s is not a cssi index (or is from an incompatible build)\n", indexfile);
 				if(daemonmode)
-					printf("ERR:EMEM\n");
+					printf("ERR:EBADINDEX:\"%s\"\n", indexfile);
+				return(1);
+			break;
+			default:
+				fprintf(output, "cssi: Error: Failed to open %s for reading!\n", indexfile);
+				if(daemonmode)
+					printf("ERR:ECANTREAD:\"%s\"\n", indexfile);
 				return(1);
+			break;
+		}
+		set->files=files;
+		if(snap_collated(set))
+			return(1);
+		fprintf(output, "cssi: loaded index %s\n", indexfile);
+		if(daemonmode)
+			printf("PARSED*\nCOLL:\n"); // so a front-end sees the same as it would have after a parse
+		say_collated(set->nerrs);
+		set->collated=set->dupsmarked=true;
+		if(snap_index(set))
+			return(1);
+		goto shell;
+	}
+	if(trace) // the trace would be a mess if files were parsed at once
+		nthreads=1;
+	if((i=parse_set(set)))
+		return(i);
+	files=set->files;
+	
+	if(watch) // a reload makes a new set from the old, which mustn't be changing under it, so collate it all now
+		lazy=background=false;
+	if(background && !saveindex) // the shell can start now; the listings wait for it in wait_collation()
+	{
+		bgcoll=(bg_collation){.entries=set->entries, .nentries=set->nentries, .fcache=set->fcache, .files=set->files, .nfiles=set->nfiles, .stage=COLL_RUNNING};
+		if(!start_collation(&bgcoll))
+			background=false; // so collate it here, then
+	}
+	else
+		background=false;
+	if(!background && (!lazy || saveindex))
+	{
+		if(collate(set->entries, set->nentries, set->fcache, set->nfiles, &set->sort, &set->nsels, &set->nerrs) || mark_dups(set->sort, set->nsels) || snap_collated(set))
+			return(1);
+		say_collated(set->nerrs);
+		set->collated=set->dupsmarked=true;
+		if(snap_index(set))
+			return(1);
+	}
+	if(saveindex && (errno=save_index(saveindex, set->filename, set->nfiles, set->entries, set->nentries, set->sort, set->nsels, set->nerrs)))
+	{
+		fprintf(output, "cssi: Error: Failed to write index %s: %s\n", saveindex, strerror(errno));
+		if(daemonmode)
+			printf("ERR:ECANTWRITE:\"%s\"\n", saveindex);
+		return(1);
+	}
+	if(watch)
+	{
+#ifdef __linux__
+		pthread_t th;
+		if((watchfd=inotify_init1(IN_CLOEXEC))>=0)
+		{
+			watch_files(set);
+			if(!pthread_create(&th, NULL, watch_thread, NULL))
+				pthread_detach(th);
+			else
+			{
+				close(watchfd);
+				watchfd=-1;
 			}
 		}
-		fclose(fp);
-		while(mfile[nlines-1][0]==0)
+		if(watchfd<0)
+#endif
 		{
-			nlines--;
-			free(mfile[nlines]);
+			fprintf(output, "cssi: warning: can't watch the files, so they won't be reloaded\n");
+			if(daemonmode)
+				printf("WARN:WNOWATCH\n");
 		}
-		
-		fprintf(output, "cssi: processing %s\n", i==nfiles?"<stdin>":filename[i]);
-		if(daemonmode)
-			printf("PROC:\"%s\"\n", i==nfiles?"<stdin>":filename[i]); // Warning; it is possible to have a file named '<stdin>', though unlikely
+	}
 	
-		// Parse it with a state machine
-		int state=0;
-		int ostate=0; // for parentheticals, e.g. comments.  Doesn't handle nesting - we'd need a stack for that - but comments can't be nested anyway
-		int line=0;
-		int pos=0;
-		int brace=0;
-		bool whitespace[]={true, true, false, true, true}; // eat up whitespace?
-		bool nonl=false;
-		const entry eblank={0, NULL, NULL, -1, -1, 0};
-		entry current=eblank;
-		int curstrlen=0;
-		char * curstring=NULL;
-		while(line<nlines)
-		{
-			char *curr=mfile[line]+pos;
-			if(trace)
-				fprintf(stderr, "%d\t%d:%d\t%hhu\t'%c'\n", state, line+1, pos+1, *curr, *curr);
-			if(*curr==0)
+	shell:
+	while(!errupt)
+	{
+		char * input=getl("cssi>");
+		if(!input)
+		{
+			fprintf(output, "cssi: unexpected EOF on stdin\n");
+			if(daemonmode)
+				printf("ERR:EEOF:stdin\n");
+			return(3);
+		}
+		char * cmd=strtok(input, " ");
+		int parmc=0; // the names are, of course, modelled on argc and argv
+		char ** parmv=NULL;
+		char *p;
+		while((p=strtok(NULL, " ")))
+		{
+			parmc++;
+			parmv=(char **)realloc(parmv, parmc*sizeof(char *));
+			parmv[parmc-1]=p;
+		}
+		if(cmd)
+		{
+			set=snap_get(); // a reload can't change it while we're using it, only swap in another for the next command
+			snap_use(set);
+			bool listing=!strncmp(cmd, "selector", strlen(cmd)) || !strncmp(cmd, "declaration", strlen(cmd)); // SelIds are sorted positions, so any listing needs the collation
+			if(listing && need_collation(set, (strncmp(cmd, "selector", strlen(cmd))==0) || needs_dups(parmc, parmv))) // sel shows the dups; decl only needs them to test 'dup'
+				return(1);
+			if(strncmp(cmd, "selector", strlen(cmd))==0) // selectors
 			{
-				if(line==nlines-1)
-				{
-					line++;
-				}
+				OUT_LOCK();
+				if(daemonmode)
+					printf("SEL...\n"); // line ending with '...' indicates "continue until a line is '.'"
 				else
+					fprintf(output, "cssi: listing SELECTORS\n");
+				bitword *show=test(parmc, parmv, set);
+				if(show)
 				{
-					fprintf(output, PARSERR"\tUnexpected EOL\n", PARSARG);
-					fprintf(output, PMKLINE);
-					if(daemonmode)
-						printf(DPARSERR"unexpected EOL\n", DPARSARG);
-					return(2);
+					for(i=bits_next(show, 0, set->nsels);i<set->nsels;i=bits_next(show, i+1, set->nsels))
+					{
+						int ent=set->sort[i].ent;
+						int file=set->entries[ent].file;
+						// and the selector straight out of the file image too
+						if(daemonmode)
+						{
+							printf("RECORD:ID=%d:FILE=\"%s\":LINE=%d:DUP=%d:SEL=\"", i, file<set->nfiles?set->filename[file]:"<stdin>", set->entries[ent].line+1, set->sort[i].dup);
+							spantext(set->sort[i].text, NULL, stdout, true);
+							printf("\"\n");
+						}
+						else
+						{
+							fprintf(output, "%d%s\tIn %s at %d:\t", i, set->sort[i].dup?set->sort[i].dup==i?"*":"+":"", file<set->nfiles?set->filename[file]:"<stdin>", set->entries[ent].line+1);
+							spantext(set->sort[i].text, NULL, output, true);
+							fprintf(output, "\n");
+						}
+					}
+					free(show);
 				}
+				if(daemonmode)
+					printf(".\n");
+				OUT_UNLOCK();
 			}
-			else if((*curr=='/') && (*(curr+1)=='*') && (state!=1)) // /* comment */
-			{
-				ostate=state;
-				state=1;
-				pos+=2;
-			}
-			else if(whitespace[state]&&(*curr=='\n'))
+			else if(strncmp(cmd, "declaration", strlen(cmd))==0) // contents of a sel's {}
 			{
-				if((state==0)&&curstring)
+				OUT_LOCK();
+				if(daemonmode)
+					printf("DECL...\n"); // line ending with '...' indicates "continue until a line is '.'"
+				else
+					fprintf(output, "cssi: listing DECLARATIONS\n");
+				bitword *show=test(parmc, parmv, set);
+				if(show)
 				{
-					curstrlen++;
-					curstring=(char *)realloc(curstring, curstrlen+1);
-					curstring[curstrlen-1]=*curr;
-					curstring[curstrlen]=0;
+					for(i=bits_next(show, 0, set->nsels);i<set->nsels;i=bits_next(show, i+1, set->nsels))
+					{
+						int ent=set->sort[i].ent;
+						// the innercode could be big, so we print it straight out of the file image
+						if(daemonmode)
+						{
+							printf("RECORD:ID=%d:DECL=\"", i);
+							spantext(set->entries[ent].innercode, NULL, stdout, false);
+							printf("\"\n");
+						}
+						else
+						{
+							fprintf(output, "%d\t{", i);
+							spantext(set->entries[ent].innercode, NULL, output, false);
+							fprintf(output, "}\n");
+						}
+					}
+					free(show);
 				}
-				free(mfile[line]);
-				line++;
-				pos=0;
-				nonl=false;
+				if(daemonmode)
+					printf(".\n");
+				OUT_UNLOCK();
 			}
-			else if(whitespace[state]&&((*curr==' ')||(*curr=='\t')))
+			else if(strncmp(cmd, "quit", strlen(cmd))==0) // quit
 			{
-				if((state==0)&&curstring)
-				{
-					curstrlen++;
-					curstring=(char *)realloc(curstring, curstrlen+1);
-					curstring[curstrlen-1]=*curr;
-					curstring[curstrlen]=0;
-				}
-				pos++;
+				// no params yet
+				errupt++;
 			}
 			else
 			{
-				switch(state)
-				{
-					case 0: // selector, comma, or braces
-						if(nonl && wnewline && (nwarnings++<maxwarnings))
-						{
-							fprintf(output, PARSEWARN"\tMissing newline between entries\n", PARSEWARG);
-							fprintf(output, PMKLINE);
-							if(daemonmode)
-								printf(DPARSEWARN"missing newline between entries\n", DPARSEWARG);
-						}
-						if(*curr==';')
-						{
-							pos++;
-						}
-						else if(*curr=='@')
-						{
-							if(((pos!=0) || current.nmatches) && watrule && (nwarnings++<maxwarnings))
-							{
-								fprintf(output, PARSEWARN"\tAt-rule not at start of line\n", PARSEWARG);
-								fprintf(output, PMKLINE);
-								if(daemonmode)
-									printf(DPARSEWARN"at-rule not at start of line\n", DPARSEWARG);
-							}
-							if(strncmp(curr, "@import", strlen("@import"))==0)
-							{
-								//TODO check it's early enough not to be ignored by the UA
-								// Also, this code isn't robust at all
-								// and we should probably be using something similar to the innercode curstring stuff, but I cba
-								char *url=strchr(curr, '(');
-								if(!url)
-								{
-									fprintf(output, PARSERR"\tMalformed @import directive\n", PARSARG);
-									fprintf(output, PMKLINE);
-									if(daemonmode)
-										printf(DPARSERR"malformed @import directive\n", DPARSARG);
-									return(2);
-								}
-								url++;
-								char *endurl=strchr(url, ')');
-								if(!endurl)
-								{
-									fprintf(output, PARSERR"\tMalformed @import directive\n", PARSARG);
-									fprintf(output, PMKLINE);
-									if(daemonmode)
-										printf(DPARSERR"malformed @import directive\n", DPARSARG);
-									return(2);
-								}
-								*endurl=0;
-								pos=(endurl-mfile[line])+1;
-								nfiles++;
-								filename=(char **)realloc(filename, nfiles*sizeof(char *));
-								if(url[0]=='/') // semi-absolute path, so we use the ipath
-								{
-									filename[nfiles-1]=(char *)malloc(strlen(assoc_ipath[i])+strlen(url)+1);
-									sprintf(filename[nfiles-1], "%s%s", assoc_ipath[i], url+1);
-								}
-								else // relative path
-								{
-									char * cpath = strdup(filename[i]);
-									while(!((cpath[strlen(cpath)-1]=='/')||(cpath[strlen(cpath)-1]==0)))
-										cpath[strlen(cpath)-1]=0;
-									filename[nfiles-1]=(char *)malloc(strlen(cpath)+strlen(url)+1);
-									sprintf(filename[nfiles-1], "%s%s", cpath, url);
-									free(cpath);
-								}
-								assoc_ipath=(char **)realloc(assoc_ipath, nfiles*sizeof(char *));
-								assoc_ipath[nfiles-1]=assoc_ipath[i];
-							}
-							else if(strncmp(curr, "@media", strlen("@media"))==0)
-							{
-								pos+=strlen("@media");
-								state=3; // ignore @media, just find the block close
-							}
-							else
-							{
-								fprintf(output, PARSERR"\tUnrecognised at-rule\n", PARSARG);
-								fprintf(output, PMKLINE);
-								if(daemonmode)
-									printf(DPARSERR"unrecognised at-rule\n", DPARSARG);
-								return(2);
-							}
-						}
-						else
-						{
-							if(current.line==-1)
-							{
-								current.line=line;
-								current.file=i;
-							}
-							if(*curr==',')
-							{
-								if(curstring)
-								{
-									current.nmatches++;
-									current.matches=(char **)realloc(current.matches, current.nmatches*sizeof(char *));
-									current.matches[current.nmatches-1]=curstring;
-									curstring=NULL; // disconnect the pointer as its target is finished
-									curstrlen=0;
-								}
-								else
-								{
-									fprintf(output, PARSERR"\tEmpty selector before comma\n", PARSARG);
-									fprintf(output, PMKLINE);
-									if(daemonmode)
-										printf(DPARSERR"empty selector before comma\n", DPARSARG);
-									return(2);
-								}
-								pos++;
-							}
-							else if(*curr=='{')
-							{
-								if(!curstring)
-								{
-									fprintf(output, PARSERR"\tEmpty selector before decl\n", PARSARG);
-									fprintf(output, PMKLINE);
-									if(daemonmode)
-										printf(DPARSERR"empty selector before decl\n", DPARSARG);
-									return(2);
-								}
-								current.nmatches++;
-								current.matches=(char **)realloc(current.matches, current.nmatches*sizeof(char *));
-								current.matches[current.nmatches-1]=curstring;
-								curstring=NULL; // disconnect the pointer as its target is finished
-								curstrlen=0;
-								state=2;
-								brace=1;
-								pos++;
-							}
-							else
-							{
-								curstrlen++;
-								curstring=(char *)realloc(curstring, curstrlen+1);
-								curstring[curstrlen-1]=*curr;
-								curstring[curstrlen]=0;
-								pos++;
-							}
-						}
-					break;
-					case 1: // comment */
-						if((*curr=='*') && (*(curr+1)=='/'))
-						{
-							state=ostate;
-							pos+=2;
-						}
-						else
-							pos++;
-					break;
-					case 2: // 'innercode \}
-						if(*curr=='{')
-						{
-							brace++;
-						}
-						else if(*curr=='}')
-						{
-							brace--;
-							if(brace==0)
-							{
-								current.innercode=curstring;
-								curstring=NULL; // disconnect the pointer as its target is finished
-								curstrlen=0;
-								current.numlines=line-current.line;
-								nentries++;
-								entries=(entry *)realloc(entries, nentries*sizeof(entry));
-								entries[nentries-1]=current;
-								current=eblank;
-								pos++;
-								state=0;
-								nonl=true;
-							}
-						}
-						if(state==2) // not closed the last brace yet, so keep adding to the string
-						{
-							curstrlen++;
-							curstring=(char *)realloc(curstring, curstrlen+1);
-							curstring[curstrlen-1]=*curr;
-							curstring[curstrlen]=0;
-							if(*curr=='\n')
-							{
-								free(mfile[line]);
-								line++;
-								pos=0;
-							}
-							else
-							{
-								pos++;
-							}
-						}
-					break;
-					case 3:
-						if(*curr==';')
-						{
-							state=0;
-						}
-						else if(*curr=='{')
-						{
-							state=4;
-							brace=1;
-						}
-						pos++;
-					break;
-					case 4:
-						if(*curr=='{')
-						{
-							brace++;
-						}
-						else if(*curr=='}')
-						{
-							brace--;
-							if(brace==0)
-								state=0;
-						}
-						pos++;
-					break;
-					default:
-						fprintf(output, PARSERR"\tNo such state!\n", PARSARG);
-						fprintf(output, PMKLINE);
-						if(daemonmode)
-							printf(DPARSERR"no such state\n", DPARSARG);
-						return(2);
-					break;
-				}
+				if(daemonmode)
+					printf("ERR:EBADCMD:\"%s\"\n", cmd);
+				else
+					fprintf(output, "cssi: Error: unrecognised command %s!\n", cmd);
 			}
+			snap_put(set);
 		}
-		free(mfile);
-		fprintf(output, "cssi: parsed %s\n", i==nfiles?"<stdin>":filename[i]);
-		if(daemonmode)
-			printf("PARSED:\"%s\"\n", i==nfiles?"<stdin>":filename[i]); // Warning; it is possible to have a file named '<stdin>', though unlikely
-		skip:;
+		if(parmv)
+			free(parmv);
+		if(input)
+			free(input);
+	}
+	return(0);
+}
+
+int parse_set(css_set * s)
+{
+	int i, nwarnings=0, rv=0;
+	s->importer=(int *)malloc(s->nfiles*sizeof(int));
+	for(i=0;i<s->nfiles;i++)
+		s->importer[i]=-1;
+	s->files=(css_file *)calloc(s->nfiles, sizeof(css_file));
+	s->fcache=(file_cache *)calloc(s->nfiles, sizeof(file_cache));
+	for(i=0;i<s->nfiles;i++)
+		queue_file(i, s->filename, s->ipath[i], wnewline, watrule);
+#ifndef _WIN32
+	pthread_t *workers=(pthread_t *)malloc(max(nthreads-1, 0)*sizeof(pthread_t)+1); // main() parses too, while it's waiting
+	int nworkers;
+	for(nworkers=0;nworkers<nthreads-1;nworkers++)
+	{
+		if(pthread_create(&workers[nworkers], NULL, parse_worker, NULL))
+			break; // carry on with what we've got; main() can parse everything itself if need be
+	}
+#endif
+	for(i=0;i<s->nfiles;i++) // merge the results in file order, so everything comes out as if we'd parsed them one at a time
+	{
+		JOB_LOCK();
+		parse_job *j=jobs[i];
+		if(j->state==JOB_QUEUED) // not taken yet, so we'll do it ourselves
+		{
+			j->state=JOB_RUNNING;
+			JOB_UNLOCK();
+			parse_file(j);
+			JOB_LOCK();
+			j->state=JOB_DONE;
+		}
+		while(j->state!=JOB_DONE)
+			JOB_WAIT();
+		JOB_UNLOCK();
+		if(j->dupof>=0)
+		{
+			if(wdupfile && (nwarnings++<maxwarnings))
+			{
+				fprintf(output, "cssi: warning: Duplicate file in set%s: %s\n", i<s->ninit?"":" (from @import)", s->filename[i]);
+				if(daemonmode)
+					printf("WARN:WDUPFILE:%d:\"%s\"\n", i<s->ninit?0:1, s->filename[i]);
+			}
+			JOB_LOCK();
+			jobs[i]=NULL;
+			JOB_UNLOCK();
+			free(j);
+			continue;
+		}
+		replay_msgs(j, &nwarnings);
+		if((rv=j->rv)) // stop here; but tidy up, as a reload carries on with the set it had
+		{
+			JOB_LOCK();
+			jobs[i]=NULL;
+			JOB_UNLOCK();
+			discard_job(j);
+			break;
+		}
+		int m;
+		s->files[i]=j->file;
+		if((s->files[i].refs=(atomic_int *)malloc(sizeof(atomic_int)))) // (without one, it's never freed)
+			atomic_init(s->files[i].refs, 1);
+		s->fcache[i]=j->cache;
+		s->entries=(entry *)realloc(s->entries, (s->nentries+j->nentries)*sizeof(entry));
+		memcpy(s->entries+s->nentries, j->entries, j->nentries*sizeof(entry));
+		for(m=0;m<j->nentries;m++) // a prefetched file didn't know its index when it was parsed
+		{
+			entry *e=&s->entries[s->nentries+m];
+			int k;
+			e->file=e->innercode.file=i;
+			for(k=0;k<e->nmatches;k++)
+				e->matches[k].file=i;
+		}
+		s->nentries+=j->nentries;
+		free(j->entries);
+		for(m=0;m<j->nimports;m++)
+		{
+			s->nfiles++;
+			s->filename=(char **)realloc(s->filename, s->nfiles*sizeof(char *));
+			s->filename[s->nfiles-1]=j->imports[m];
+			s->ipath=(char **)realloc(s->ipath, s->nfiles*sizeof(char *));
+			s->ipath[s->nfiles-1]=s->ipath[i];
+			s->importer=(int *)realloc(s->importer, s->nfiles*sizeof(int));
+			s->importer[s->nfiles-1]=i;
+			s->files=(css_file *)realloc(s->files, s->nfiles*sizeof(css_file));
+			memset(&s->files[s->nfiles-1], 0, sizeof(css_file));
+			s->fcache=(file_cache *)realloc(s->fcache, s->nfiles*sizeof(file_cache));
+			memset(&s->fcache[s->nfiles-1], 0, sizeof(file_cache));
+			queue_file(s->nfiles-1, s->filename, s->ipath[i], wnewline, watrule);
+		}
+		free(j->imports);
+		JOB_LOCK();
+		jobs[i]=NULL;
+		JOB_UNLOCK();
+		if(j->prefetched)
+			free(j->name);
+		free(j);
+	}
+#ifndef _WIN32
+	JOB_LOCK();
+	jobsdone=true;
+	pthread_cond_broadcast(&jobcond);
+	JOB_UNLOCK();
+	while(nworkers)
+		pthread_join(workers[--nworkers], NULL);
+	free(workers);
+#endif
+	for(i=0;i<njobs;i++) // after an error, those we didn't get to
+	{
+		if(jobs[i])
+			discard_job(jobs[i]);
 	}
+	for(i=0;i<nprefq;i++) // any that were never adopted (there shouldn't be any, unless there was an error)
+	{
+		if(prefq[i])
+			discard_job(prefq[i]);
+	}
+	free(prefq);
+	free(jobs);
+	free(chunkq);
+	prefq=chunkq=jobs=NULL; // so another parse_set() can start afresh
+	nprefq=nextpref=nchunkq=nextchunk=njobs=nexttake=0;
+	jobsdone=false;
+	if(rv)
+		return(rv);
 	fprintf(output, "cssi: Parsing completed\n");
 	if(daemonmode)
 		printf("PARSED*\n");
@@ -622,188 +1153,2502 @@ int main(int argc, char *argv[])
 		if(daemonmode)
 			printf("XSWARN:%d\n", nwarnings-maxwarnings);
 	}
-	
-	fprintf(output, "cssi: collating & parsing selectors\n");
-	if(daemonmode)
-		printf("COLL:\n");
-	int nsels=0;
-	selector * sels=NULL;
-	for(i=0;i<nentries;i++)
+	return(0);
+}
+
+void replay_msgs(parse_job * j, int * nwarnings)
+{
+	int m, lastwarn=0;
+	bool showwarn=false;
+	for(m=0;m<j->nmsgs;m++)
 	{
-		int j;
-		for(j=0;j<entries[i].nmatches;j++)
+		jmsg *msg=&j->msgs[m];
+		if(msg->warn!=lastwarn) // a new warning; we couldn't count them till now, since we didn't know how many the files before had
 		{
-			nsels++;
-			sels=(selector *)realloc(sels, nsels*sizeof(selector));
-			sels[nsels-1].text=entries[i].matches[j];
-			char *txt=sels[nsels-1].text;
-			while(strlen(txt) && (txt[strlen(txt)-1]==' ')) // strip trailing whitespace
-				txt[strlen(txt)-1]=0;
-			sels[nsels-1].ent=i;
-			sels[nsels-1].chain=NULL;
-			sels[nsels-1].dup=0;
+			lastwarn=msg->warn;
+			showwarn=msg->warn && ((*nwarnings)++<maxwarnings);
 		}
+		if(showwarn || !msg->warn)
+			fputs(msg->text, msg->tostdout?stdout:output);
+		free(msg->text);
 	}
-	
-	int nerrs=0;
-	for(i=0;i<nsels;i++)
+	free(j->msgs);
+	j->msgs=NULL;
+	j->nmsgs=0;
+}
+
+void discard_job(parse_job * j)
+{
+	int m;
+	for(m=0;m<j->nmsgs;m++)
+		free(j->msgs[m].text);
+	free(j->msgs);
+	for(m=0;m<j->nentries;m++)
+		free(j->entries[m].matches);
+	free(j->entries);
+	for(m=0;m<j->nimports;m++)
+		free(j->imports[m]);
+	free(j->imports);
+	unload_file(&j->file);
+	free(j->cache.path);
+	free(j->cache.blob);
+	if(j->prefetched)
+		free(j->name);
+	free(j);
+}
+
+int reload_file(css_set * s, int i, int * nwarnings)
+{
+	parse_job *j=(parse_job *)calloc(1, sizeof(parse_job));
+	if(!j)
+		goto nomem;
+	*j=(parse_job){.i=i, .name=s->filename[i], .ipath=s->ipath[i], .wnewline=wnewline, .watrule=watrule, .dupof=-1, .state=JOB_RUNNING};
+	parse_file(j);
+	int k, m=0, e;
+	if(!j->rv)
 	{
-		int e;
-		if((e=parse_selector(&sels[i], i))) // assigns & tests NZ
+		for(k=0;k<s->nfiles;k++) // the same @imports, in the same order?
 		{
-			nerrs++;
+			if(s->importer[k]!=i)
+				continue;
+			if((m>=j->nimports) || strcmp(j->imports[m], s->filename[k]))
+				break;
+			m++;
+		}
+		if((k<s->nfiles) || (m<j->nimports)) // the set itself has changed; that's for reparse_set(), which will say all this again
+		{
+			discard_job(j);
+			return(1);
 		}
 	}
-	
-	selector * sort=selmergesort(sels, nsels);
-	int dup=0;
-	for(i=0;i<nsels-1;i++)
+	replay_msgs(j, nwarnings);
+	if(j->rv) // keep what we had; the file may well be fixed by its next change
+	{
+		discard_job(j);
+		return(2);
+	}
+	int a, b; // its entries, in s->entries
+	for(a=0;(a<s->nentries)&&(s->entries[a].file<i);a++);
+	for(b=a;(b<s->nentries)&&(s->entries[b].file==i);b++);
+	int delta=j->nentries-(b-a);
+	entry *ne=(entry *)malloc((s->nentries+delta+1)*sizeof(entry));
+	if(!ne)
+		goto nomem;
+	memcpy(ne, s->entries, a*sizeof(entry));
+	if(j->nentries) // (an empty file has no entries array at all)
+		memcpy(ne+a, j->entries, j->nentries*sizeof(entry));
+	memcpy(ne+a+j->nentries, s->entries+b, (s->nentries-b)*sizeof(entry));
+	css_file oldfile=s->files[i]; // the new selectors must be read from the new image
+	s->files[i]=j->file;
+	for(e=a;e<a+j->nentries;e++) // (it may have come from the cache, which doesn't know the file's index)
+	{
+		ne[e].file=ne[e].innercode.file=i;
+		for(k=0;k<ne[e].nmatches;k++)
+			ne[e].matches[k].file=i;
+	}
+	if(s->collated) // take its old selectors out of sort[], and merge its new ones in; the rest don't move relative to each other
 	{
-		if(treecmp(sort[i].chain, sort[i+1].chain)==0)
+		int nnew=0, n=0, nold=0, nerrs;
+		for(e=a;e<a+j->nentries;e++)
+			nnew+=ne[e].nmatches;
+		selector *sels=(selector *)malloc((nnew+1)*sizeof(selector)), *ns=NULL, *merged=(selector *)malloc((s->nsels+nnew+1)*sizeof(selector));
+		if(!(sels && merged))
 		{
-			sort[i].dup=dup?dup:(dup=i);
-			sort[i+1].dup=dup;
+			free(sels);
+			free(merged);
+			free(ne);
+			s->files[i]=oldfile;
+			goto nomem;
 		}
-		else
-			dup=0;
+		for(e=a;e<a+j->nentries;e++)
+		{
+			for(k=0;k<ne[e].nmatches;k++,n++)
+				sels[n]=(selector){.text=ne[e].matches[k], .ent=e, .group=n};
+		}
+		file_cache *fc=&j->cache;
+		fc->sel0=0;
+		fc->nsel=nnew;
+		static arena cachearena={NULL}; // like collate()'s
+		if(fc->hit)
+			cache_chains(fc, sels, &cachearena);
+		if((nerrs=parse_sels(sels, nnew))<0)
+		{
+			free(sels);
+			free(merged);
+			free(ne);
+			s->files[i]=oldfile;
+			goto nomem;
+		}
+		if(fc->path && !fc->hit && !fc->bad)
+			cache_write(fc, sels);
+		rank_atoms(); // the new atoms fall among the old ones, but the old ones keep their order, so sort[] is still sorted
+		if(nnew && !(ns=selsort(sels, nnew)))
+		{
+			free(sels);
+			free(merged);
+			free(ne);
+			s->files[i]=oldfile;
+			goto nomem;
+		}
+		free(sels);
+		for(k=0;k<s->nsels;k++)
+		{
+			selector *o=&s->sort[k];
+			if((o->ent>=a) && (o->ent<b))
+			{
+				if(!o->chain)
+					s->nerrs--;
+				continue;
+			}
+			if(o->ent>=b)
+				o->ent+=delta;
+			s->sort[nold++]=*o;
+		}
+		int p=0, q=0;
+		for(n=0;n<nold+nnew;n++)
+			merged[n]=((q==nnew) || ((p<nold) && (selcmp(&s->sort[p], &ns[q])<=0)))?s->sort[p++]:ns[q++];
+		free(ns);
+		free(s->sort);
+		s->sort=merged;
+		s->nsels=nold+nnew;
+		s->nerrs+=nerrs;
+		if(s->dupsmarked && mark_dups(s->sort, s->nsels)) // the dup values are sorted positions, so they all have to be found again anyway
+		{
+			free(ne);
+			s->files[i]=oldfile;
+			discard_job(j);
+			return(-1);
+		}
+		free(fc->path);
+		free(fc->blob);
+		fc->path=fc->blob=NULL;
 	}
-	
-	fprintf(output, "cssi: collated & parsed selectors\n");
-	if(nerrs)
-		fprintf(output, "cssi:  there were %d errors.\n", nerrs);
+	if((s->files[i].refs=(atomic_int *)malloc(sizeof(atomic_int))))
+		atomic_init(s->files[i].refs, 1);
+	file_put(&oldfile, s->entries+a, b-a); // (the set s was copied from still has it)
+	free(s->entries);
+	s->entries=ne;
+	s->nentries+=delta;
+	free(s->fcache[i].path);
+	free(s->fcache[i].blob);
+	s->fcache[i]=j->cache;
+	for(m=0;m<j->nimports;m++)
+		free(j->imports[m]);
+	free(j->imports);
+	free(j->entries);
+	free(j);
+	return(0);
+	nomem:
+	if(j)
+		discard_job(j);
+	fprintf(output, "cssi: Error: Failed to alloc mem for reloading %s.\n", s->filename[i]);
 	if(daemonmode)
-		printf("COLL*:%d\n", nerrs);
-	
-	int errupt=0;
-	while(!errupt)
+		printf("ERR:EMEM\n");
+	return(-1);
+}
+
+css_set * reparse_set(css_set * s)
+{
+	css_set *n=(css_set *)calloc(1, sizeof(css_set));
+	char **fn=(char **)malloc((s->ninit+1)*sizeof(char *)), **ip=(char **)malloc((s->ninit+1)*sizeof(char *));
+	if(!(n && fn && ip))
 	{
-		char * input=getl("cssi>");
-		if(!input)
+		free(n);
+		free(fn);
+		free(ip);
+		fprintf(output, "cssi: Error: Failed to alloc mem for the file set.\n");
+		if(daemonmode)
+			printf("ERR:EMEM\n");
+		return(NULL);
+	}
+	memcpy(fn, s->filename, s->ninit*sizeof(char *)); // argv's, so they outlive every set
+	memcpy(ip, s->ipath, s->ninit*sizeof(char *));
+	*n=(css_set){.filename=fn, .ipath=ip, .nfiles=s->ninit, .ninit=s->ninit};
+	atomic_init(&n->refs, 1);
+	int i;
+	for(i=0;i<nprefq;i++) // anything a reload_file() prefetched
+	{
+		if(prefq[i])
+			discard_job(prefq[i]);
+	}
+	free(prefq);
+	prefq=NULL;
+	nprefq=nextpref=0;
+	for(i=0;i<nfnodes;i++) // forget the import graph too; an editor may have replaced the files with new ones
+		free(fnodes[i].name);
+	free(fnodes);
+	free(fnhash);
+	fnodes=NULL;
+	fnhash=NULL;
+	nfnodes=0;
+	fnhsize=0;
+	atoms=NULL; // and start a new intern table; the old set's is still in use
+	natoms=atomhsize=0;
+	atomhash=atomrank=NULL;
+	atomset=NULL;
+	if(parse_set(n))
+		goto fail;
+	files=n->files;
+	if(collate(n->entries, n->nentries, n->fcache, n->nfiles, &n->sort, &n->nsels, &n->nerrs) || mark_dups(n->sort, n->nsels) || snap_collated(n))
+		goto fail;
+	say_collated(n->nerrs);
+	n->collated=n->dupsmarked=true;
+	return(n);
+	fail:
+	snap_collated(n); // so snap_free() gets the intern table too (and if this fails as well, it's only a leak)
+	snap_free(n);
+	return(NULL);
+}
+
+void watch_files(css_set * s)
+{
+#ifdef __linux__
+	int *nw=(int *)realloc(watchwd, (s->nfiles+1)*sizeof(int)), i;
+	if(!nw)
+		return;
+	watchwd=nw;
+	for(i=0;i<s->nfiles;i++) // the directory, not the file, as editors often save by writing a new file and renaming it over the old
+	{
+		char *name=s->filename[i], *slash=strrchr(name, '/');
+		watchwd[i]=-1;
+		if(!strcmp(name, "-"))
+			continue;
+		char dir[slash?slash-name+2:2];
+		if(slash)
 		{
-			fprintf(output, "cssi: unexpected EOF on stdin\n");
-			if(daemonmode)
-				printf("ERR:EEOF:stdin\n");
-			return(3);
+			memcpy(dir, name, slash-name+1);
+			dir[slash-name+1]=0;
 		}
-		char * cmd=strtok(input, " ");
-		int parmc=0; // the names are, of course, modelled on argc and argv
-		char ** parmv=NULL;
-		char *p;
-		while((p=strtok(NULL, " ")))
+		else
+			strcpy(dir, ".");
+		watchwd[i]=inotify_add_watch(watchfd, dir, IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE|IN_MODIFY|IN_ATTRIB); // (the same directory gets the same watch)
+	}
+#endif
+}
+
+void * watch_thread(void * arg)
+{
+	(void)arg;
+#ifdef __linux__
+	struct pollfd pf={.fd=watchfd, .events=POLLIN};
+	while(true)
+	{
+		if(poll(&pf, 1, -1)<=0)
+			continue;
+		css_set *s=snap_get(), *n=NULL; // only we publish, so this stays current till we do
+		bool *dirty=(bool *)calloc(s->nfiles+1, sizeof(bool));
+		union
 		{
-			parmc++;
-			parmv=(char **)realloc(parmv, parmc*sizeof(char *));
-			parmv[parmc-1]=p;
+			struct inotify_event ev; // for the alignment
+			char buf[4096];
 		}
-		if(cmd)
+		ib;
+		int i, rv=0, nreloaded=0, nwarnings=0;
+		do // until it's been quiet for a while
 		{
-			if(strncmp(cmd, "selector", strlen(cmd))==0) // selectors
+			ssize_t len=read(watchfd, ib.buf, sizeof(ib.buf)), off=0;
+			while(dirty && (off+(ssize_t)sizeof(struct inotify_event)<=len))
 			{
-				if(daemonmode)
-					printf("SEL...\n"); // line ending with '...' indicates "continue until a line is '.'"
-				else
-					fprintf(output, "cssi: listing SELECTORS\n");
-				bool *show=test(parmc, parmv, sort, entries, filename, nsels);
-				if(show)
+				struct inotify_event *ev=(struct inotify_event *)(ib.buf+off);
+				for(i=0;ev->len && (i<s->nfiles);i++)
 				{
-					for(i=0;i<nsels;i++)
-					{
-						int ent=sort[i].ent;
-						int file=entries[ent].file;
-						if(show[i])
-						{
-							if(daemonmode)
-								printf("RECORD:ID=%d:FILE=\"%s\":LINE=%d:DUP=%d:SEL=\"%s\"\n", i, file<nfiles?filename[file]:"<stdin>", entries[ent].line+1, sort[i].dup, sort[i].text);
-							else
-								fprintf(output, "%d%s\tIn %s at %d:\t%s\n", i, sort[i].dup?sort[i].dup==i?"*":"+":"", file<nfiles?filename[file]:"<stdin>", entries[ent].line+1, sort[i].text);
-						}
-					}
-					free(show);
+					char *base=strrchr(s->filename[i], '/');
+					if((watchwd[i]==ev->wd) && !strcmp(ev->name, base?base+1:s->filename[i]))
+						dirty[i]=true;
 				}
-				if(daemonmode)
-					printf(".\n");
+				off+=sizeof(struct inotify_event)+ev->len;
 			}
-			else if(strncmp(cmd, "declaration", strlen(cmd))==0) // contents of a sel's {}
+		}
+		while(poll(&pf, 1, WATCH_SETTLE)>0);
+		for(i=0;dirty && (i<s->nfiles) && !rv;i++)
+		{
+			struct stat st;
+			if(!dirty[i] || !s->files[i].buf) // a duplicate (or stdin) has nothing to reload
+				continue;
+			if(stat(s->filename[i], &st) || (((size_t)st.st_size==s->files[i].len) && (st.st_mtime==s->files[i].mtime) && (ST_MTIME_NS(st)==s->files[i].mtimens))) // it's gone (for now), or hasn't really changed
+				continue;
+			if(!n) // the shell may be reading s, so the changes go into a copy
 			{
-				if(daemonmode)
-					printf("DECL...\n"); // line ending with '...' indicates "continue until a line is '.'"
-				else
-					fprintf(output, "cssi: listing DECLARATIONS\n");
-				bool *show=test(parmc, parmv, sort, entries, filename, nsels);
-				if(show)
+				if(!(n=snap_copy(s)))
 				{
-					for(i=0;i<nsels;i++)
-					{
-						int ent=sort[i].ent;
-						if(show[i])
-						{
-							if(daemonmode)
-								printf("RECORD:ID=%d:DECL=\"%s\"\n", i, entries[ent].innercode);
-							else
-								fprintf(output, "%d\t{%s}\n", i, entries[ent].innercode);
-						}
-					}
-					free(show);
+					fprintf(output, "cssi: Error: Failed to alloc mem for reloading %s.\n", s->filename[i]);
+					if(daemonmode)
+						printf("ERR:EMEM\n");
+					break;
 				}
-				if(daemonmode)
-					printf(".\n");
+				snap_use(n);
 			}
-			else if(strncmp(cmd, "quit", strlen(cmd))==0) // quit
+			if(!(rv=reload_file(n, i, &nwarnings)))
+				nreloaded++;
+			else if(rv==2)
+				rv=0;
+		}
+		free(dirty);
+		if(rv==1)
+		{
+			fprintf(output, "cssi: the @imports have changed, so parsing everything again\n");
+			snap_free(n);
+			if((n=reparse_set(s)))
 			{
-				// no params yet
-				errupt++;
+				watch_files(n);
+				nreloaded=n->nfiles;
 			}
+		}
+		else if(nwarnings>maxwarnings)
+		{
+			fprintf(output, "cssi: warning: %d more warnings were not displayed.\n", nwarnings-maxwarnings);
+			if(daemonmode)
+				printf("XSWARN:%d\n", nwarnings-maxwarnings);
+		}
+		if(n && (snap_collated(n) || (rv<0) || !nreloaded || snap_index(n))) // (after running out of memory, n is in no state to use; the shell keeps s)
+		{
+			snap_free(n);
+			n=NULL;
+		}
+		snap_put(s);
+		if(n)
+		{
+			int k=0;
+			for(i=0;i<n->nentries;i++)
+				k+=n->entries[i].nmatches;
+			snap_publish(n);
+			OUT_LOCK(); // not in the middle of a listing
+			fprintf(output, "cssi: reloaded, %d selectors\n", k);
+			if(daemonmode)
+				printf("RELOAD:%d\n", k);
 			else
+				printf("cssi>");
+			fflush(stdout);
+			OUT_UNLOCK();
+		}
+	}
+#endif
+	return(NULL);
+}
+
+css_set * snap_get(void)
+{
+	atomic_fetch_add(&snapgetting, 1);
+	css_set *s=atomic_load(&current);
+	atomic_fetch_add(&s->refs, 1);
+	atomic_fetch_sub(&snapgetting, 1);
+	return(s);
+}
+
+void snap_put(css_set * s)
+{
+	if(atomic_fetch_sub(&s->refs, 1)==1)
+		snap_free(s);
+}
+
+void snap_use(css_set * s)
+{
+	files=s->files;
+	atoms=s->atoms;
+	natoms=s->natoms;
+	atomhash=s->atomhash;
+	atomhsize=s->atomhsize;
+	atomrank=s->atomrank;
+	atomset=s;
+}
+
+int snap_collated(css_set * s)
+{
+	s->atoms=atoms;
+	s->natoms=natoms;
+	s->atomhash=atomhash;
+	s->atomhsize=atomhsize;
+	s->atomrank=atomrank;
+	atomset=s;
+	free(s->lmatch);
+	if(!(s->lmatch=(bitword *)calloc(BITWORDS(s->nsels)+1, sizeof(bitword))))
+	{
+		fprintf(output, "cssi: Error: Failed to alloc mem for selector flags.\n");
+		if(daemonmode)
+			printf("ERR:EMEM\n");
+		return(1);
+	}
+	return(0);
+}
+
+int snap_index(css_set * s)
+{
+	int i, f, e;
+	if(!s->byline)
+	{
+		int *count=(int *)calloc(s->nentries+1, sizeof(int)); // the entries are in file order, and in line order within a file, so sorting by entry sorts by (file, line)
+		s->byline=(int *)malloc((s->nsels+1)*sizeof(int));
+		s->fileoff=(int *)malloc((s->nfiles+1)*sizeof(int));
+		if(!(count && s->byline && s->fileoff))
+		{
+			free(count);
+			free(s->byline);
+			free(s->fileoff);
+			s->byline=s->fileoff=NULL;
+			goto nomem;
+		}
+		for(i=0;i<s->nsels;i++)
+			count[s->sort[i].ent]++;
+		for(e=0, f=0, i=0;e<=s->nentries;e++) // (into starts, and the files' starts with them)
+		{
+			for(;(f<s->nfiles) && ((e==s->nentries) || (f<=s->entries[e].file));f++)
+				s->fileoff[f]=i;
+			if(e<s->nentries)
+			{
+				int n=count[e];
+				count[e]=i;
+				i+=n;
+			}
+		}
+		s->fileoff[s->nfiles]=s->nsels;
+		for(i=0;i<s->nsels;i++) // in SelId order, so each entry's run is too
+			s->byline[count[s->sort[i].ent]++]=i;
+		free(count);
+	}
+	if(!s->ancmask)
+	{
+		if(!(s->ancmask=(bitword *)malloc((s->nsels+1)*sizeof(bitword))))
+			goto nomem;
+		for(i=0;i<s->nsels;i++)
+			s->ancmask[i]=anc_mask(s->sort[i].chain);
+	}
+	if(!s->byrule)
+	{
+		unsigned int nk=RULE_KEYS(s->natoms), k;
+		s->byrule=(int *)malloc((s->nsels+1)*sizeof(int));
+		s->ruleoff=(int *)calloc(nk+1, sizeof(int));
+		if(!(s->byrule && s->ruleoff))
+		{
+			free(s->byrule);
+			free(s->ruleoff);
+			s->byrule=s->ruleoff=NULL;
+			goto nomem;
+		}
+		for(i=0;i<s->nsels;i++)
+			s->ruleoff[rule_key(s->sort[i].chain, s->natoms)+1]++;
+		for(k=0;k<nk;k++)
+			s->ruleoff[k+1]+=s->ruleoff[k];
+		for(i=0;i<s->nsels;i++) // each bucket in SelId order; this leaves ruleoff[k] where bucket k ends, ie. where k+1 starts
+			s->byrule[s->ruleoff[rule_key(s->sort[i].chain, s->natoms)]++]=i;
+		memmove(s->ruleoff+1, s->ruleoff, nk*sizeof(int));
+		s->ruleoff[0]=0;
+	}
+	if(s->dupsmarked && !s->dupsels)
+	{
+		if(!(s->dupsels=(int *)malloc((s->nsels+1)*sizeof(int))))
+			goto nomem;
+		s->ndupsels=0;
+		for(i=0;i<s->nsels;i++)
+		{
+			if(s->sort[i].dup)
+				s->dupsels[s->ndupsels++]=i;
+		}
+	}
+	return(0);
+	nomem:
+	fprintf(output, "cssi: Error: Failed to alloc mem for indexing selectors.\n");
+	if(daemonmode)
+		printf("ERR:EMEM\n");
+	return(1);
+}
+
+void snap_publish(css_set * s)
+{
+	css_set *old=atomic_exchange(&current, s);
+	while(atomic_load(&snapgetting)) // someone may have loaded old, but not yet counted themselves in its refs; they're only a few instructions from doing so
+		;
+	snap_put(old);
+}
+
+css_set * snap_copy(css_set * s)
+{
+	css_set *n=(css_set *)calloc(1, sizeof(css_set));
+	if(!n)
+		return(NULL);
+	int nf=s->nfiles, k;
+	*n=(css_set){.ipath=s->ipath, .nfiles=nf, .ninit=s->ninit, .nentries=s->nentries, .nsels=s->nsels, .nerrs=s->nerrs, .collated=s->collated, .dupsmarked=s->dupsmarked, .natoms=s->natoms, .atomhsize=s->atomhsize};
+	atomic_init(&n->refs, 1);
+	n->filename=(char **)calloc(nf+1, sizeof(char *));
+	n->ipath=(char **)malloc((nf+1)*sizeof(char *));
+	n->importer=(int *)malloc((nf+1)*sizeof(int));
+	n->fcache=(file_cache *)calloc(nf+1, sizeof(file_cache)); // after collating, there's nothing in them to copy
+	n->files=(css_file *)calloc(nf+1, sizeof(css_file));
+	n->entries=(entry *)malloc((s->nentries+1)*sizeof(entry));
+	n->sort=(selector *)malloc((s->nsels+1)*sizeof(selector));
+	n->atoms=(char **)malloc(s->natoms*sizeof(char *));
+	n->atomhash=(unsigned int *)malloc(s->atomhsize*sizeof(unsigned int));
+	n->atomrank=(unsigned int *)malloc(s->natoms*sizeof(unsigned int)); // (it's collated, so they're ranked)
+	bool ok=n->filename && n->ipath && n->importer && n->fcache && n->files && n->entries && n->sort && n->atoms && n->atomhash && n->atomrank;
+	for(k=0;ok && (k<nf);k++)
+		ok=(k<s->ninit) || (n->filename[k]=strdup(s->filename[k])); // each set frees the @imported names it has
+	if(!ok)
+	{
+		n->nfiles=k; // only the names are ours yet
+		n->nentries=0;
+		snap_free(n);
+		return(NULL);
+	}
+	memcpy(n->filename, s->filename, s->ninit*sizeof(char *));
+	memcpy(n->ipath, s->ipath, nf*sizeof(char *));
+	memcpy(n->importer, s->importer, nf*sizeof(int));
+	memcpy(n->files, s->files, nf*sizeof(css_file));
+	memcpy(n->entries, s->entries, s->nentries*sizeof(entry));
+	memcpy(n->sort, s->sort, s->nsels*sizeof(selector));
+	memcpy(n->atoms, s->atoms, s->natoms*sizeof(char *));
+	memcpy(n->atomhash, s->atomhash, s->atomhsize*sizeof(unsigned int));
+	memcpy(n->atomrank, s->atomrank, s->natoms*sizeof(unsigned int));
+	for(k=0;k<nf;k++)
+	{
+		if(n->files[k].refs)
+			atomic_fetch_add(n->files[k].refs, 1);
+	}
+	return(n);
+}
+
+void snap_free(css_set * s)
+{
+	if(!s)
+		return;
+	if(s==atomset) // intern() may have realloc()ed its table since s was told where it was
+	{
+		s->atoms=atoms;
+		s->natoms=natoms;
+		s->atomhash=atomhash;
+		s->atomhsize=atomhsize;
+		s->atomrank=atomrank; // (rank_atoms() realloc()s it too)
+		atoms=NULL;
+		natoms=atomhsize=0;
+		atomhash=atomrank=NULL;
+		atomset=NULL;
+	}
+	int i, e=0;
+	for(i=0;i<s->nfiles;i++)
+	{
+		int e0=e;
+		while((e<s->nentries)&&(s->entries[e].file==i))
+			e++;
+		if(s->files)
+			file_put(&s->files[i], s->entries+e0, e-e0);
+		if(s->fcache)
+		{
+			free(s->fcache[i].path);
+			free(s->fcache[i].blob);
+		}
+		if(s->filename && (i>=s->ninit))
+			free(s->filename[i]);
+	}
+	free(s->filename);
+	free(s->ipath);
+	free(s->importer);
+	free(s->fcache);
+	free(s->files);
+	free(s->entries);
+	free(s->sort);
+	free(s->lmatch);
+	free(s->byline);
+	free(s->fileoff);
+	free(s->dupsels);
+	free(s->byrule);
+	free(s->ruleoff);
+	free(s->ancmask);
+	free(s->atoms);
+	free(s->atomhash);
+	free(s->atomrank);
+	free(s);
+}
+
+void file_put(css_file * f, entry * ents, int nents)
+{
+	if(!f->refs || (atomic_fetch_sub(f->refs, 1)>1))
+		return;
+	int e;
+	for(e=0;e<nents;e++)
+		free(ents[e].matches);
+	free(f->refs);
+	f->refs=NULL;
+	unload_file(f);
+}
+
+void parse_file(parse_job * j)
+{
+	css_file *mf=&j->file;
+	switch(load_file(j->name, mf))
+	{
+		case 0:
+		break;
+		case 2:
+			jprintf(j, output, "cssi: Error: Failed to alloc mem for input file.\n");
+			jprintf(j, stderr, "malloc/realloc: %s\n", strerror(errno));
+			if(daemonmode)
+				jprintf(j, stdout, "ERR:EMEM\n");
+			j->rv=1;
+			return;
+		break;
+		default:
+			jprintf(j, output, "cssi: Error: Failed to open %s for reading!\n", j->name);
+			if(daemonmode)
+				jprintf(j, stdout, "ERR:ECANTREAD:\"%s\"\n", j->name);
+			j->rv=1;
+			return;
+		break;
+	}
+	
+	if(cachedir && !trace && strcmp(j->name, "-") && cache_load(j, mf)) // the trace wouldn't be the same, so don't use it
+		return;
+	
+	jprintf(j, output, "cssi: processing %s\n", j->name);
+	if(daemonmode)
+		jprintf(j, stdout, "PROC:\"%s\"\n", j->name); // Warning; it is possible to have a file named '<stdin>', though unlikely
+	
+	size_t *cuts=NULL;
+	int *cutlines=NULL, nchunks=0;
+	if((nthreads>1) && (mf->len>=2*CHUNK_MIN))
+	{
+		int maxchunks=2*nthreads;
+		cuts=(size_t *)malloc((maxchunks+1)*sizeof(size_t));
+		cutlines=(int *)malloc((maxchunks+1)*sizeof(int));
+		if(cuts && cutlines)
+			nchunks=find_chunks(mf, max(CHUNK_MIN, mf->len/maxchunks), cuts, cutlines, maxchunks);
+	}
+	if(nchunks>1)
+		parse_chunks(j, mf, cuts, cutlines, nchunks);
+	else
+		parse_range(j, mf, 0, mf->len, 0);
+	free(cuts);
+	free(cutlines);
+	if(j->rv)
+		return;
+	jprintf(j, output, "cssi: parsed %s\n", j->name);
+	if(daemonmode)
+		jprintf(j, stdout, "PARSED:\"%s\"\n", j->name); // Warning; it is possible to have a file named '<stdin>', though unlikely
+	if(j->cache.path)
+		cache_save(j, mf);
+}
+
+void parse_range(parse_job * j, css_file * mf, size_t off, size_t end, int line)
+{
+	int i=j->i;
+	// Parse it with a state machine
+	int state=0;
+	int ostate=0; // for parentheticals, e.g. comments.  Doesn't handle nesting - we'd need a stack for that - but comments can't be nested anyway
+	int brace=0;
+	bool whitespace[]={true, true, false, true, true}; // eat up whitespace?
+	bool nonl=false;
+	const entry eblank={0, NULL, {i, 0, 0}, -1, -1, 0};
+	entry current=eblank;
+	span curstring={i, 0, 0}; // the selector or innercode we're in the middle of
+	bool instring=false; // have we started curstring yet?
+	while(off<end)
+	{
+		char *curr=mf->buf+off;
+		if(!trace && ((state==1)||(state==2)||(state==4))) // in these states, most bytes just get stepped over, so skip straight to the next one that matters
+		{
+			int nl=0;
+			char *stop=(state==1)?scan_special(curr, mf->buf+end, '*', '*', '*', &nl):scan_special(curr, mf->buf+end, '{', '}', '/', &nl);
+			if(stop>curr)
+			{
+				line+=nl;
+				if(nl && (state!=2)) // whitespace[] eats the '\n's in 1 and 4
+					nonl=false;
+				off=stop-mf->buf;
+				continue;
+			}
+		}
+		if(trace)
+			fprintf(stderr, "%d\t%d:%d\t%hhu\t'%c'\n", state, line+1, lcol(mf, line, off)+1, *curr, *curr);
+		if(*curr==0) // stray NUL in the input; skip it, as fgetl() used to
+		{
+			off++;
+		}
+		else if((*curr=='/') && (*(curr+1)=='*') && (state!=1)) // /* comment */
+		{
+			ostate=state;
+			state=1;
+			off+=2;
+		}
+		else if(whitespace[state]&&(*curr=='\n'))
+		{
+			off++;
+			line++;
+			nonl=false;
+		}
+		else if(whitespace[state]&&((*curr==' ')||(*curr=='\t')))
+		{
+			off++;
+		}
+		else
+		{
+			switch(state)
+			{
+				case 0: // selector, comma, or braces
+					if(nonl && j->wnewline && jwarn(j))
+					{
+						jwprintf(j, output, PARSEWARN"\tMissing newline between entries\n", PARSEWARG);
+						jwprintf(j, output, PMKLINE);
+						if(daemonmode)
+							jwprintf(j, stdout, DPARSEWARN"missing newline between entries\n", DPARSEWARG);
+					}
+					if(*curr==';')
+					{
+						off++;
+					}
+					else if(*curr=='@')
+					{
+						if(((off && (curr[-1]!='\n')) || current.nmatches) && j->watrule && jwarn(j))
+						{
+							jwprintf(j, output, PARSEWARN"\tAt-rule not at start of line\n", PARSEWARG);
+							jwprintf(j, output, PMKLINE);
+							if(daemonmode)
+								jwprintf(j, stdout, DPARSEWARN"at-rule not at start of line\n", DPARSEWARG);
+						}
+						if(strncmp(curr, "@import", strlen("@import"))==0)
+						{
+							//TODO check it's early enough not to be ignored by the UA
+							// Also, this code isn't robust at all
+							// and we should probably be using something similar to the innercode curstring stuff, but I cba
+							char *eol=memchr(curr, '\n', mf->len-off);
+							if(!eol)
+								eol=mf->buf+mf->len;
+							char *url=memchr(curr, '(', eol-curr);
+							if(!url)
+							{
+								jprintf(j, output, PARSERR"\tMalformed @import directive\n", PARSARG);
+								jprintf(j, output, PMKLINE);
+								if(daemonmode)
+									jprintf(j, stdout, DPARSERR"malformed @import directive\n", DPARSARG);
+								j->rv=2;
+								return;
+							}
+							url++;
+							char *endurl=memchr(url, ')', eol-url);
+							if(!endurl)
+							{
+								jprintf(j, output, PARSERR"\tMalformed @import directive\n", PARSARG);
+								jprintf(j, output, PMKLINE);
+								if(daemonmode)
+									jprintf(j, stdout, DPARSERR"malformed @import directive\n", DPARSARG);
+								j->rv=2;
+								return;
+							}
+							int urllen=endurl-url;
+							off=(endurl-mf->buf)+1;
+							char *imp;
+							if(url[0]=='/') // semi-absolute path, so we use the ipath
+							{
+								imp=(char *)malloc(strlen(j->ipath)+urllen);
+								sprintf(imp, "%s%.*s", j->ipath, urllen-1, url+1);
+							}
+							else // relative path
+							{
+								char *slash=strrchr(j->name, '/');
+								int cplen=slash?slash+1-j->name:0; // the directory part, including its '/'
+								imp=(char *)malloc(cplen+urllen+1);
+								sprintf(imp, "%.*s%.*s", cplen, j->name, urllen, url);
+							}
+							j->nimports++;
+							j->imports=(char **)realloc(j->imports, j->nimports*sizeof(char *));
+							j->imports[j->nimports-1]=imp; // main() queues it once the files before this one are done, so it gets the same index as it always did
+							prefetch_file(j, imp); // but a worker can make a start on it now
+						}
+						else if(strncmp(curr, "@media", strlen("@media"))==0)
+						{
+							off+=strlen("@media");
+							state=3; // ignore @media, just find the block close
+						}
+						else
+						{
+							jprintf(j, output, PARSERR"\tUnrecognised at-rule\n", PARSARG);
+							jprintf(j, output, PMKLINE);
+							if(daemonmode)
+								jprintf(j, stdout, DPARSERR"unrecognised at-rule\n", DPARSARG);
+							j->rv=2;
+							return;
+						}
+					}
+					else
+					{
+						if(current.line==-1)
+						{
+							current.line=line;
+							current.file=i;
+						}
+						if(*curr==',')
+						{
+							if(instring)
+							{
+								curstring.len=off-curstring.off;
+								current.nmatches++;
+								current.matches=(span *)realloc(current.matches, current.nmatches*sizeof(span));
+								current.matches[current.nmatches-1]=curstring;
+								instring=false;
+							}
+							else
+							{
+								jprintf(j, output, PARSERR"\tEmpty selector before comma\n", PARSARG);
+								jprintf(j, output, PMKLINE);
+								if(daemonmode)
+									jprintf(j, stdout, DPARSERR"empty selector before comma\n", DPARSARG);
+								j->rv=2;
+								return;
+							}
+							off++;
+						}
+						else if(*curr=='{')
+						{
+							if(!instring)
+							{
+								jprintf(j, output, PARSERR"\tEmpty selector before decl\n", PARSARG);
+								jprintf(j, output, PMKLINE);
+								if(daemonmode)
+									jprintf(j, stdout, DPARSERR"empty selector before decl\n", DPARSARG);
+								j->rv=2;
+								return;
+							}
+							curstring.len=off-curstring.off;
+							current.nmatches++;
+							current.matches=(span *)realloc(current.matches, current.nmatches*sizeof(span));
+							current.matches[current.nmatches-1]=curstring;
+							state=2;
+							brace=1;
+							off++;
+							curstring.off=off; // the innercode starts straight after the brace
+						}
+						else
+						{
+							if(!instring)
+							{
+								curstring.off=off;
+								instring=true;
+							}
+							off++;
+						}
+					}
+				break;
+				case 1: // comment */
+					if((*curr=='*') && (*(curr+1)=='/'))
+					{
+						state=ostate;
+						off+=2;
+					}
+					else
+						off++;
+				break;
+				case 2: // 'innercode \}
+					if(*curr=='{')
+					{
+						brace++;
+					}
+					else if(*curr=='}')
+					{
+						brace--;
+						if(brace==0)
+						{
+							curstring.len=off-curstring.off;
+							current.innercode=curstring;
+							instring=false;
+							current.numlines=line-current.line;
+							j->nentries++;
+							j->entries=(entry *)realloc(j->entries, j->nentries*sizeof(entry));
+							j->entries[j->nentries-1]=current;
+							current=eblank;
+							off++;
+							state=0;
+							nonl=true;
+						}
+					}
+					if(state==2) // not closed the last brace yet, so keep going
+					{
+						if(*curr=='\n')
+							line++;
+						off++;
+					}
+				break;
+				case 3:
+					if(*curr==';')
+					{
+						state=0;
+					}
+					else if(*curr=='{')
+					{
+						state=4;
+						brace=1;
+					}
+					off++;
+				break;
+				case 4:
+					if(*curr=='{')
+					{
+						brace++;
+					}
+					else if(*curr=='}')
+					{
+						brace--;
+						if(brace==0)
+							state=0;
+					}
+					off++;
+				break;
+				default:
+					jprintf(j, output, PARSERR"\tNo such state!\n", PARSARG);
+					jprintf(j, output, PMKLINE);
+					if(daemonmode)
+						jprintf(j, stdout, DPARSERR"no such state\n", DPARSARG);
+					j->rv=2;
+					return;
+				break;
+			}
+		}
+	}
+}
+
+int find_chunks(css_file * mf, size_t target, size_t * cuts, int * cutlines, int maxchunks)
+{
+	// a cut goes at the start of a line where parse_range() would be in state 0 with nothing pending, so it mirrors the states that matter: 0, 1 (comment), 2 (innercode), 3 & 4 (@media), and the @import skip
+	int n=0, state=0, ostate=0, brace=0, line=0;
+	bool clean=true; // nothing pending in state 0 (no selector started)
+	size_t off=0, next=target;
+	cuts[n]=0;
+	cutlines[n++]=0;
+	while(off<mf->len)
+	{
+		char *curr=mf->buf+off;
+		if((off>=next) && !state && clean && (curr[-1]=='\n'))
+		{
+			if(n==maxchunks)
+				break;
+			cuts[n]=off;
+			cutlines[n++]=line;
+			next=off+target;
+		}
+		if((state==1)||(state==2)||(state==4))
+		{
+			int nl=0;
+			char *stop=(state==1)?scan_special(curr, mf->buf+mf->len, '*', '*', '*', &nl):scan_special(curr, mf->buf+mf->len, '{', '}', '/', &nl);
+			if(stop>curr)
+			{
+				line+=nl;
+				off=stop-mf->buf;
+				continue;
+			}
+		}
+		if(*curr==0)
+		{
+			off++;
+			continue;
+		}
+		if((*curr=='/') && (curr[1]=='*') && (state!=1))
+		{
+			ostate=state;
+			state=1;
+			off+=2;
+			continue;
+		}
+		if(*curr=='\n')
+			line++;
+		switch(state)
+		{
+			case 0:
+				if(strchr(" \t\n;", *curr))
+					break;
+				if(*curr=='@')
+				{
+					if(strncmp(curr, "@import", strlen("@import"))==0) // skips to the ')', as the parser does
+					{
+						char *eol=memchr(curr, '\n', mf->len-off);
+						if(!eol)
+							eol=mf->buf+mf->len;
+						char *url=memchr(curr, '(', eol-curr), *endurl=url?memchr(url+1, ')', eol-url-1):NULL;
+						if(!endurl)
+							goto out; // it's a parse error, so nothing after here matters
+						off=(endurl-mf->buf)+1;
+						continue;
+					}
+					else if(strncmp(curr, "@media", strlen("@media"))==0)
+					{
+						state=3;
+						off+=strlen("@media");
+						continue;
+					}
+					goto out;
+				}
+				if(*curr=='{')
+				{
+					state=2;
+					brace=1;
+				}
+				clean=false;
+			break;
+			case 1:
+				if((*curr=='*') && (curr[1]=='/'))
+				{
+					state=ostate;
+					off++;
+				}
+			break;
+			case 2:
+			case 4:
+				if(*curr=='{')
+					brace++;
+				else if((*curr=='}') && !--brace)
+				{
+					if(state==2) // end of a rule, which empties current
+						clean=true;
+					state=0;
+				}
+			break;
+			case 3:
+				if(*curr==';')
+					state=0;
+				else if(*curr=='{')
+				{
+					state=4;
+					brace=1;
+				}
+			break;
+		}
+		off++;
+	}
+	out:
+	cuts[n]=mf->len;
+	return(n);
+}
+
+char * scan_special(char * p, char * end, char a, char b, char c, int * lines)
+{
+#if defined(NOSIMD)
+#elif defined(__AVX2__)
+	__m256i va=_mm256_set1_epi8(a), vb=_mm256_set1_epi8(b), vc=_mm256_set1_epi8(c), vn=_mm256_set1_epi8('\n');
+	while(end-p>=32)
+	{
+		__m256i v=_mm256_loadu_si256((__m256i *)p);
+		unsigned int hit=_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)), _mm256_cmpeq_epi8(v, vc)));
+		unsigned int nls=_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vn));
+		if(hit)
+		{
+			int at=__builtin_ctz(hit);
+			*lines+=__builtin_popcount(nls&((1u<<at)-1));
+			return(p+at);
+		}
+		*lines+=__builtin_popcount(nls);
+		p+=32;
+	}
+#elif defined(__SSE2__)
+	__m128i va=_mm_set1_epi8(a), vb=_mm_set1_epi8(b), vc=_mm_set1_epi8(c), vn=_mm_set1_epi8('\n');
+	while(end-p>=16)
+	{
+		__m128i v=_mm_loadu_si128((__m128i *)p);
+		unsigned int hit=_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)), _mm_cmpeq_epi8(v, vc)));
+		unsigned int nls=_mm_movemask_epi8(_mm_cmpeq_epi8(v, vn));
+		if(hit)
+		{
+			int at=__builtin_ctz(hit);
+			*lines+=__builtin_popcount(nls&((1u<<at)-1));
+			return(p+at);
+		}
+		*lines+=__builtin_popcount(nls);
+		p+=16;
+	}
+#endif
+	for(;p<end;p++) // the tail, or everything if we've no SIMD
+	{
+		if((*p==a)||(*p==b)||(*p==c))
+			return(p);
+		if(*p=='\n')
+			(*lines)++;
+	}
+	return(end);
+}
+
+void parse_chunks(parse_job * j, css_file * mf, size_t * cuts, int * cutlines, int nchunks)
+{
+	line_start(mf, 0); // build the line index now, before the chunks share mf
+	parse_job *c[nchunks];
+	int k;
+	for(k=0;k<nchunks;k++)
+	{
+		if(!(c[k]=(parse_job *)calloc(1, sizeof(parse_job))))
+		{
+			while(k--)
+				free(c[k]);
+			parse_range(j, mf, 0, mf->len, 0); // just do it the slow way
+			return;
+		}
+		*c[k]=(parse_job){.i=j->i, .name=j->name, .ipath=j->ipath, .wnewline=j->wnewline, .watrule=j->watrule, .dupof=-1, .mf=mf, .start=cuts[k], .end=cuts[k+1], .line0=cutlines[k], .state=JOB_QUEUED};
+	}
+	JOB_LOCK();
+	chunkq=(parse_job **)realloc(chunkq, (nchunkq+nchunks)*sizeof(parse_job *));
+	for(k=0;k<nchunks;k++)
+	{
+		c[k]->qidx=nchunkq;
+		chunkq[nchunkq++]=c[k];
+	}
+	JOB_SIGNAL();
+	JOB_UNLOCK();
+	for(k=0;k<nchunks;k++) // stitch them together in order, doing any that no-one's taken yet
+	{
+		JOB_LOCK();
+		if(c[k]->state==JOB_QUEUED)
+		{
+			c[k]->state=JOB_RUNNING;
+			JOB_UNLOCK();
+			if(!j->rv) // after an error, we'd never have parsed the rest
+				parse_range(c[k], mf, c[k]->start, c[k]->end, c[k]->line0);
+			JOB_LOCK();
+			c[k]->state=JOB_DONE;
+		}
+		while(c[k]->state!=JOB_DONE)
+			JOB_WAIT();
+		chunkq[c[k]->qidx]=NULL;
+		JOB_UNLOCK();
+		int m;
+		for(m=0;m<c[k]->nmsgs;m++)
+		{
+			if(j->rv)
+				free(c[k]->msgs[m].text);
+			else
+			{
+				jmsg msg=c[k]->msgs[m];
+				if(msg.warn)
+					msg.warn+=j->nwarn;
+				jmsg *msgs=(jmsg *)realloc(j->msgs, (j->nmsgs+1)*sizeof(jmsg));
+				if(msgs)
+				{
+					j->msgs=msgs;
+					j->msgs[j->nmsgs++]=msg;
+				}
+				else
+					free(msg.text);
+			}
+		}
+		free(c[k]->msgs);
+		if(!j->rv)
+		{
+			j->nwarn+=c[k]->nwarn;
+			j->entries=(entry *)realloc(j->entries, (j->nentries+c[k]->nentries)*sizeof(entry));
+			memcpy(j->entries+j->nentries, c[k]->entries, c[k]->nentries*sizeof(entry));
+			j->nentries+=c[k]->nentries;
+			j->imports=(char **)realloc(j->imports, (j->nimports+c[k]->nimports)*sizeof(char *));
+			memcpy(j->imports+j->nimports, c[k]->imports, c[k]->nimports*sizeof(char *));
+			j->nimports+=c[k]->nimports;
+			j->rv=c[k]->rv;
+		}
+		else
+		{
+			for(m=0;m<c[k]->nimports;m++)
+				free(c[k]->imports[m]);
+			for(m=0;m<c[k]->nentries;m++)
+				free(c[k]->entries[m].matches);
+		}
+		free(c[k]->entries);
+		free(c[k]->imports);
+		free(c[k]);
+	}
+}
+
+parse_job * queue_file(int i, char ** filename, char * ipath, bool wnewline, bool watrule)
+{
+	file_node key={.name=filename[i]};
+	file_id(&key);
+	JOB_LOCK();
+	int n=file_find(&key);
+	parse_job *j=NULL;
+	bool first=(n<0); // the first time it's in the set
+	if((n>=0) && (fnodes[n].idx<0)) // it's been prefetched, so adopt that
+	{
+		j=fnodes[n].job;
+		fnodes[n].idx=i;
+		fnodes[n].job=NULL; // (its j->i stays -1, as it may be being parsed; main() knows where it goes)
+		first=true;
+		if(j->state==JOB_QUEUED) // nobody has started it, so it can still take the name (and -I= path) a serial run would have given it
+		{
+			free(j->name);
+			*j=(parse_job){.i=-1, .name=filename[i], .ipath=ipath, .wnewline=wnewline, .watrule=watrule, .dupof=-1, .state=JOB_QUEUED, .qidx=j->qidx};
+		}
+		if(!strcmp(j->name, filename[i]) && !strcmp(j->ipath, ipath) && (j->wnewline==wnewline) && (j->watrule==watrule))
+			prefq[j->qidx]=NULL; // it's ours now, so the workers can only get at it through jobs[]
+		else // it was found under another name, which its messages and @imports used; so it's left in prefq[] to be discarded, and parsed again as this
+			j=NULL;
+	}
+	if(!j)
+	{
+		key.idx=i;
+		if(!(j=(parse_job *)calloc(1, sizeof(parse_job))) || ((n<0) && (file_add(&key)<0)))
+		{
+			fprintf(output, "cssi: Error: Failed to alloc mem for parse job.\n");
+			if(daemonmode)
+				printf("ERR:EMEM\n");
+			exit(1);
+		}
+		j->i=i;
+		j->name=filename[i];
+		j->ipath=ipath;
+		j->wnewline=wnewline;
+		j->watrule=watrule;
+		j->dupof=first?-1:fnodes[n].idx;
+		j->state=(j->dupof<0)?JOB_QUEUED:JOB_DONE; // duplicates are always skipped
+	}
+	jobs=(parse_job **)realloc(jobs, (njobs+1)*sizeof(parse_job *));
+	jobs[njobs++]=j;
+	JOB_SIGNAL();
+	JOB_UNLOCK();
+	return(j);
+}
+
+void prefetch_file(parse_job * parent, char * name)
+{
+	if((nthreads<2) || !strcmp(name, "-")) // nobody to do it; and stdin had better wait its turn
+		return;
+	file_node key={.name=name, .idx=-1};
+	file_id(&key);
+	parse_job *j=(parse_job *)calloc(1, sizeof(parse_job));
+	if(!j || !(j->name=strdup(name))) // it's only a prefetch, so main() can still do it later
+	{
+		free(j);
+		return;
+	}
+	*j=(parse_job){.i=-1, .name=j->name, .ipath=parent->ipath, .wnewline=parent->wnewline, .watrule=parent->watrule, .dupof=-1, .state=JOB_QUEUED, .prefetched=true};
+	key.job=j;
+	JOB_LOCK();
+	parse_job **nq=NULL;
+	if((file_find(&key)>=0) || !(nq=(parse_job **)realloc(prefq, (nprefq+1)*sizeof(parse_job *))) || (file_add(&key)<0)) // already seen (or being seen to)
+	{
+		if(nq)
+			prefq=nq;
+		JOB_UNLOCK();
+		free(j->name);
+		free(j);
+		return;
+	}
+	prefq=nq;
+	j->qidx=nprefq;
+	prefq[nprefq++]=j;
+	JOB_SIGNAL();
+	JOB_UNLOCK();
+}
+
+void file_id(file_node * n)
+{
+	struct stat st;
+	n->dev=0;
+	n->ino=0;
+	if(strcmp(n->name, "-") && !stat(n->name, &st))
+	{
+		n->dev=st.st_dev;
+		n->ino=st.st_ino;
+	}
+}
+
+unsigned int file_hash(file_node * n)
+{
+	unsigned int h=2166136261u; // FNV-1a, over the identity if we have one, else the name
+	if(n->dev || n->ino)
+	{
+		unsigned long long id[2]={n->dev, n->ino};
+		size_t k;
+		for(k=0;k<sizeof(id);k++)
+			h=(h^((unsigned char *)id)[k])*16777619u;
+	}
+	else
+	{
+		const char *t;
+		for(t=n->name;*t;t++)
+			h=(h^(unsigned char)*t)*16777619u;
+	}
+	return(h);
+}
+
+int file_find(file_node * key)
+{
+	if(!fnhsize)
+		return(-1);
+	unsigned int b=file_hash(key)&(fnhsize-1);
+	bool byid=key->dev || key->ino;
+	while(fnhash[b])
+	{
+		file_node *n=&fnodes[fnhash[b]-1];
+		if(byid?((n->dev==key->dev) && (n->ino==key->ino)):(!(n->dev || n->ino) && !strcmp(n->name, key->name)))
+			return(fnhash[b]-1);
+		b=(b+1)&(fnhsize-1);
+	}
+	return(-1);
+}
+
+int file_add(file_node * key)
+{
+	if((nfnodes+1)*2>fnhsize) // keep it at most half full
+	{
+		unsigned int nsize=fnhsize?fnhsize*2:64;
+		int *nh=(int *)calloc(nsize, sizeof(int)), k;
+		if(!nh)
+			return(-1);
+		for(k=0;k<nfnodes;k++)
+		{
+			unsigned int b=file_hash(&fnodes[k])&(nsize-1);
+			while(nh[b])
+				b=(b+1)&(nsize-1);
+			nh[b]=k+1;
+		}
+		free(fnhash);
+		fnhash=nh;
+		fnhsize=nsize;
+	}
+	file_node *nn=(file_node *)realloc(fnodes, (nfnodes+1)*sizeof(file_node));
+	if(!nn)
+		return(-1);
+	fnodes=nn;
+	if(!(fnodes[nfnodes].name=strdup(key->name))) // the job's copy may not live as long as we do
+		return(-1);
+	fnodes[nfnodes].dev=key->dev;
+	fnodes[nfnodes].ino=key->ino;
+	fnodes[nfnodes].idx=key->idx;
+	fnodes[nfnodes].job=key->job;
+	unsigned int b=file_hash(key)&(fnhsize-1);
+	while(fnhash[b])
+		b=(b+1)&(fnhsize-1);
+	fnhash[b]=++nfnodes;
+	return(nfnodes-1);
+}
+
+#ifndef _WIN32
+void * parse_worker(void * arg)
+{
+	JOB_LOCK();
+	while(!jobsdone)
+	{
+		if(nextchunk<nchunkq) // someone's waiting on these
+		{
+			parse_job *c=chunkq[nextchunk++];
+			if(c && (c->state==JOB_QUEUED))
+			{
+				c->state=JOB_RUNNING;
+				JOB_UNLOCK();
+				parse_range(c, c->mf, c->start, c->end, c->line0);
+				JOB_LOCK();
+				c->state=JOB_DONE;
+				pthread_cond_broadcast(&jobcond);
+			}
+		}
+		else if((nexttake<njobs) || (nextpref<nprefq)) // files main() is waiting on come before prefetches
+		{
+			parse_job *j=(nexttake<njobs)?jobs[nexttake++]:prefq[nextpref++];
+			if(j && (j->state==JOB_QUEUED)) // main() may have got to it first (and even be finished with it)
+			{
+				j->state=JOB_RUNNING;
+				JOB_UNLOCK();
+				parse_file(j);
+				JOB_LOCK();
+				j->state=JOB_DONE;
+				pthread_cond_broadcast(&jobcond);
+			}
+		}
+		else
+			JOB_WAIT();
+	}
+	JOB_UNLOCK();
+	return(NULL);
+}
+#endif
+
+int collate(entry * entries, int nentries, file_cache * fcache, int nfiles, selector ** sort, int * nsels, int * nerrs)
+{
+	fprintf(output, "cssi: collating & parsing selectors\n");
+	if(daemonmode)
+		printf("COLL:\n");
+	int i, j, n=0;
+	for(i=0;i<nentries;i++)
+		n+=entries[i].nmatches;
+	selector *sels=(selector *)malloc((n+1)*sizeof(selector));
+	if(!sels)
+		goto nomem;
+	n=0;
+	for(i=0;i<nentries;i++)
+	{
+		file_cache *fc=&fcache[entries[i].file];
+		if(!fc->nsel)
+			fc->sel0=n;
+		fc->nsel+=entries[i].nmatches;
+		for(j=0;j<entries[i].nmatches;j++,n++)
+			sels[n]=(selector){.text=entries[i].matches[j], .ent=i, .group=n};
+	}
+	
+	static arena cachearena={NULL}; // holds the chains that come from the cache; parse_sels() has its own
+	for(i=0;i<nfiles;i++)
+	{
+		if(fcache[i].hit)
+			cache_chains(&fcache[i], sels, &cachearena);
+	}
+	if((*nerrs=parse_sels(sels, n))<0)
+		goto nomem;
+	if(background) // someone may be waiting on us, so let them know how it's going
+	{
+		fprintf(output, "cssi: parsed selectors, sorting\n");
+		if(daemonmode)
+			printf("COLLP:PARSED:%d\n", *nerrs);
+	}
+	for(i=0;i<nfiles;i++)
+	{
+		if(fcache[i].path && !fcache[i].hit && !fcache[i].bad)
+			cache_write(&fcache[i], sels);
+		free(fcache[i].path);
+		free(fcache[i].blob);
+		fcache[i].path=fcache[i].blob=NULL;
+	}
+	rank_atoms();
+	
+	if(!(*sort=selsort(sels, n)) && n)
+	{
+		fprintf(output, "cssi: Error: Failed to alloc mem for sorting selectors.\n");
+		if(daemonmode)
+			printf("ERR:EMEM\n");
+		return(1);
+	}
+	free(sels);
+	*nsels=n;
+	if(background)
+	{
+		fprintf(output, "cssi: sorted selectors, finding duplicates\n");
+		if(daemonmode)
+			printf("COLLP:SORTED:%d\n", n);
+	}
+	return(0);
+	nomem:
+	fprintf(output, "cssi: Error: Failed to alloc mem for collating selectors.\n");
+	if(daemonmode)
+		printf("ERR:EMEM\n");
+	return(1);
+}
+
+int parse_sels(selector * sels, int nsels)
+{
+	int ntasks=max(min(nthreads, nsels/SELS_MIN), 1), t, i;
+	sel_task *tasks=(sel_task *)calloc(ntasks, sizeof(sel_task));
+	bool *fresh=(bool *)calloc(nsels+1, sizeof(bool));
+	if(!(tasks && fresh))
+	{
+		free(tasks);
+		free(fresh);
+		return(-1);
+	}
+	for(t=0;t<ntasks;t++)
+		tasks[t]=(sel_task){.sels=sels, .lo=(long long)nsels*t/ntasks, .hi=(long long)nsels*(t+1)/ntasks, .fresh=fresh, .files=files};
+#ifndef _WIN32
+	pthread_t th[ntasks];
+	for(t=1;t<ntasks;t++) // main() does the first range itself, straight into its own intern table
+	{
+		tasks[t].threaded=true;
+		if(pthread_create(&th[t], NULL, parse_sel_range, &tasks[t]))
+			tasks[t].threaded=false;
+	}
+#endif
+	parse_sel_range(&tasks[0]);
+	int nerrs=tasks[0].nerrs, rv=0;
+	for(t=1;t<ntasks;t++)
+	{
+		sel_task *st=&tasks[t];
+#ifndef _WIN32
+		if(st->threaded)
+			pthread_join(th[t], NULL);
+		else
+#endif
+			parse_sel_range(st); // it couldn't have a thread, so do it here, where the atoms are already ours
+		unsigned int k, f;
+		if(st->atoms) // map its atoms into ours, and rename them in its chains; the order of the selfs and the fps depend only on the strings, so they still hold
+		{
+			atom *map=(atom *)malloc(st->natoms*sizeof(atom));
+			if(!map)
+				rv=-1;
+			for(k=1;map && (k<st->natoms);k++)
+			{
+				if(!(map[k]=intern(st->atoms[k], strlen(st->atoms[k]), true)))
+					rv=-1;
+			}
+			for(i=st->lo;map && (i<st->hi);i++)
+			{
+				sel_chain *c=sels[i].chain;
+				if(!fresh[i] || !c)
+					continue;
+				for(f=0;f<c->nselfs;f++)
+				{
+					if(CH_SELFS(c)[f].name)
+						CH_SELFS(c)[f].name=map[CH_SELFS(c)[f].name];
+				}
+			}
+			free(map);
+			free(st->atoms);
+			free(st->atomhash);
+			arena_free(&st->atomarena);
+		}
+		nerrs+=st->nerrs;
+	}
+	for(t=0;t<ntasks;t++) // and now what they had to say, in order
+	{
+		for(i=0;i<tasks[t].msgs.nmsgs;i++)
+		{
+			fputs(tasks[t].msgs.msgs[i].text, tasks[t].msgs.msgs[i].tostdout?stdout:output);
+			free(tasks[t].msgs.msgs[i].text);
+		}
+		free(tasks[t].msgs.msgs);
+	}
+	free(tasks); // but not their chains arenas, which hold the chains for as long as we run
+	free(fresh);
+	return(rv?rv:nerrs);
+}
+
+void * parse_sel_range(void * arg)
+{
+	sel_task *st=(sel_task *)arg;
+	int i;
+	char *txt=NULL; // the text of each selector, in turn
+	size_t txtsize=0;
+	files=st->files;
+	for(i=st->lo;i<st->hi;i++)
+	{
+		if(st->sels[i].chain) // it came from the cache
+			continue;
+		if(st->sels[i].text.len+1>txtsize)
+		{
+			char *t=(char *)realloc(txt, st->sels[i].text.len+1);
+			if(!t) // then it's left unparsed, like one with an error
+			{
+				st->nerrs++;
+				continue;
+			}
+			txt=t;
+			txtsize=st->sels[i].text.len+1;
+		}
+		spantext(st->sels[i].text, txt, NULL, true);
+		if(parse_selector(&st->sels[i], txt, i, &st->chains, &st->msgs))
+			st->nerrs++;
+		st->fresh[i]=true;
+	}
+	free(txt);
+	if(st->threaded) // hand over its intern table, so main() can make sense of its atoms
+	{
+		st->atoms=atoms;
+		st->natoms=natoms;
+		st->atomhash=atomhash;
+		st->atomarena=atomarena;
+	}
+	return(NULL);
+}
+
+int mark_dups(selector * sort, int nsels)
+{
+	int i;
+	if(dup_groups(sort, nsels))
+	{
+		fprintf(output, "cssi: Error: Failed to alloc mem for finding duplicates.\n");
+		if(daemonmode)
+			printf("ERR:EMEM\n");
+		return(1);
+	}
+	int *gsize=(int *)calloc(nsels+1, sizeof(int)), *gfirst=(int *)malloc((nsels+1)*sizeof(int)); // by group: how many, and the sorted position of the first
+	if(!gsize || !gfirst)
+	{
+		free(gsize);
+		free(gfirst);
+		fprintf(output, "cssi: Error: Failed to alloc mem for finding duplicates.\n");
+		if(daemonmode)
+			printf("ERR:EMEM\n");
+		return(1);
+	}
+	for(i=0;i<nsels;i++)
+	{
+		gsize[sort[i].group]++;
+		gfirst[sort[i].group]=-1;
+	}
+	for(i=0;i<nsels;i++)
+	{
+		int g=sort[i].group;
+		if(gfirst[g]<0)
+			gfirst[g]=i; // equal chains sort together, so this is the start of the dup block
+		if(gfirst[g])
+			sort[i].dup=(gsize[g]>1)?gfirst[g]:0;
+		else // dup=0 means "no dups", so a block at the very start is marked as if it began at 1 (as it always has been)
+			sort[i].dup=(i && (gsize[g]>2))?1:0;
+	}
+	free(gsize);
+	free(gfirst);
+	return(0);
+}
+
+void say_collated(int nerrs)
+{
+	fprintf(output, "cssi: collated & parsed selectors\n");
+	if(nerrs)
+		fprintf(output, "cssi:  there were %d errors.\n", nerrs);
+	if(daemonmode)
+		printf("COLL*:%d\n", nerrs);
+}
+
+bool start_collation(bg_collation * b)
+{
+#ifndef _WIN32
+	pthread_t th;
+	if(!pthread_create(&th, NULL, collate_bg, b))
+	{
+		pthread_detach(th);
+		return(true);
+	}
+#endif
+	return(false);
+}
+
+void * collate_bg(void * arg)
+{
+	bg_collation *b=(bg_collation *)arg;
+	collstage stage=COLL_FAILED;
+	files=b->files;
+	if(!collate(b->entries, b->nentries, b->fcache, b->nfiles, &b->sort, &b->nsels, &b->nerrs))
+	{
+		b->atoms=atoms; // it's finished with them (dup_groups() only reads atomrank[], as the shell will), and the shell's match= trees must use the same ones
+		b->natoms=natoms;
+		b->atomhash=atomhash;
+		b->atomhsize=atomhsize;
+		b->atomrank=atomrank;
+		b->atomarena=atomarena;
+		JOB_LOCK();
+		b->stage=COLL_SORTED;
+		JOB_SIGNAL();
+		JOB_UNLOCK();
+		if(!mark_dups(b->sort, b->nsels))
+		{
+			say_collated(b->nerrs);
+			stage=COLL_DONE;
+		}
+	}
+	JOB_LOCK();
+	b->stage=stage;
+	JOB_SIGNAL();
+	JOB_UNLOCK();
+	return(NULL);
+}
+
+int wait_collation(bg_collation * b, collstage stage)
+{
+	JOB_LOCK();
+	while((b->stage!=COLL_FAILED)&&(b->stage<stage))
+		JOB_WAIT();
+	collstage got=b->stage;
+	JOB_UNLOCK();
+	if(got==COLL_FAILED)
+		return(1);
+	if(b->atoms)
+	{
+		atoms=b->atoms;
+		natoms=b->natoms;
+		atomhash=b->atomhash;
+		atomhsize=b->atomhsize;
+		atomrank=b->atomrank;
+		atomarena=b->atomarena;
+		b->atoms=NULL;
+	}
+	return(0);
+}
+
+int need_collation(css_set * s, bool dups)
+{
+	if(!s->collated)
+	{
+		if(background)
+		{
+			if(wait_collation(&bgcoll, COLL_SORTED))
+				return(1);
+			s->sort=bgcoll.sort;
+			s->nsels=bgcoll.nsels;
+			s->nerrs=bgcoll.nerrs;
+		}
+		else
+		{
+			if(collate(s->entries, s->nentries, s->fcache, s->nfiles, &s->sort, &s->nsels, &s->nerrs))
+				return(1);
+			say_collated(s->nerrs);
+		}
+		if(snap_collated(s))
+			return(1);
+		s->collated=true;
+	}
+	if(dups && !s->dupsmarked)
+	{
+		if(background?wait_collation(&bgcoll, COLL_DONE):mark_dups(s->sort, s->nsels))
+			return(1);
+		s->dupsmarked=true;
+	}
+	return(snap_index(s));
+}
+
+bool needs_dups(int parmc, char *parmv[])
+{
+	int i;
+	for(i=0;i<parmc;i++)
+	{
+		char *p=parmv[i]+(parmv[i][0]=='!');
+		if(!strncmp(p, "dup", 3) && !isalnum(p[3]))
+			return(true);
+	}
+	return(false);
+}
+
+unsigned long long fnv64(const void * p, size_t len, unsigned long long h)
+{
+	const unsigned char *b=(const unsigned char *)p;
+	size_t i;
+	for(i=0;i<len;i++)
+		h=(h^b[i])*1099511628211ull;
+	return(h);
+}
+
+char * cache_path(parse_job * j)
+{
+	// everything that changes what the parse says goes in the name: the file (as it's named, since the messages and @import paths depend on that, and as it really is), the importpath, the version and the options
+	char *real=realpath(j->name, NULL);
+	if(!real)
+		return(NULL);
+	bool opts[3]={daemonmode, j->wnewline, j->watrule};
+	unsigned long long h=FNV64_BASIS;
+	h=fnv64(j->name, strlen(j->name)+1, h);
+	h=fnv64(real, strlen(real)+1, h);
+	h=fnv64(j->ipath, strlen(j->ipath)+1, h);
+	h=fnv64(VERSION, strlen(VERSION)+1, h);
+	h=fnv64(opts, sizeof(opts), h);
+	free(real);
+	char *path=(char *)malloc(strlen(cachedir)+23);
+	if(path)
+		sprintf(path, "%s/%016llx.cssi", cachedir, h);
+	return(path);
+}
+
+bool cache_load(parse_job * j, css_file * mf)
+{
+	css_file cf;
+	if(!(j->cache.path=cache_path(j)) || load_file(j->cache.path, &cf))
+		return(false);
+	char *p=cf.buf, *end=cf.buf+cf.len;
+	cache_hdr h;
+	unsigned int k, m;
+	if(!cget(&p, end, &h, sizeof(h)) || memcmp(h.magic, CACHE_MAGIC, 8) || (h.size!=mf->len))
+		goto miss;
+	if((h.mtime!=mf->mtime) || (h.mtimens!=mf->mtimens))
+	{
+		if(h.hash!=fnv64(mf->buf, mf->len, FNV64_BASIS))
+			goto miss;
+		h.mtime=mf->mtime; // it's only been touched; update the header so the quick check works next time
+		h.mtimens=mf->mtimens;
+		int fd=open(j->cache.path, O_WRONLY);
+		if(fd>=0)
+		{
+			if(pwrite(fd, &h, sizeof(h), 0)!=sizeof(h))
+				h.mtime=0; // no matter; we'll just hash it again next time
+			close(fd);
+		}
+	}
+	for(k=0;k<h.nmsgs;k++)
+	{
+		jmsg msg;
+		unsigned int len;
+		int tostdout;
+		if(!cget(&p, end, &msg.warn, sizeof(int)) || !cget(&p, end, &tostdout, sizeof(int)) || !cget(&p, end, &len, sizeof(len)) || (len>(size_t)(end-p)))
+			goto bad;
+		jmsg *nm=(jmsg *)realloc(j->msgs, (j->nmsgs+1)*sizeof(jmsg));
+		if(!nm || !(msg.text=(char *)malloc(len+1)))
+		{
+			if(nm)
+				j->msgs=nm;
+			goto bad;
+		}
+		j->msgs=nm;
+		memcpy(msg.text, p, len);
+		msg.text[len]=0;
+		msg.tostdout=tostdout;
+		p+=len;
+		j->msgs[j->nmsgs++]=msg;
+	}
+	j->nwarn=h.nwarn;
+	if(!(j->entries=(entry *)calloc(h.nentries+1, sizeof(entry))))
+		goto bad;
+	for(k=0;k<h.nentries;k++)
+	{
+		entry *e=&j->entries[k];
+		int v[5]; // line, numlines, nmatches, innercode off & len
+		if(!cget(&p, end, v, sizeof(v)) || (v[2]<0) || (v[3]<0) || (v[4]<0) || ((size_t)v[3]+v[4]>mf->len))
+			goto bad;
+		*e=(entry){0, NULL, {-1, v[3], v[4]}, -1, v[0], v[1]};
+		j->nentries++;
+		if(!(e->matches=(span *)malloc(max(v[2], 1)*sizeof(span))))
+			goto bad;
+		for(m=0;m<(unsigned int)v[2];m++)
+		{
+			int sp[2];
+			if(!cget(&p, end, sp, sizeof(sp)) || (sp[0]<0) || (sp[1]<0) || ((size_t)sp[0]+sp[1]>mf->len))
+				goto bad;
+			e->matches[e->nmatches++]=(span){-1, sp[0], sp[1]};
+		}
+	}
+	for(k=0;k<h.nimports;k++)
+	{
+		unsigned int len;
+		char *imp, **ni;
+		if(!cget(&p, end, &len, sizeof(len)) || (len>(size_t)(end-p)) || !(imp=(char *)malloc(len+1)))
+			goto bad;
+		if(!(ni=(char **)realloc(j->imports, (j->nimports+1)*sizeof(char *))))
+		{
+			free(imp);
+			goto bad;
+		}
+		memcpy(imp, p, len);
+		imp[len]=0;
+		p+=len;
+		j->imports=ni;
+		j->imports[j->nimports++]=imp;
+	}
+	if(!(j->cache.blob=(char *)malloc(max(end-p, 1))))
+		goto bad;
+	memcpy(j->cache.blob, p, end-p);
+	j->cache.len=end-p;
+	j->cache.hit=true;
+	for(k=0;k<(unsigned int)j->nimports;k++)
+		prefetch_file(j, j->imports[k]);
+	unload_file(&cf);
+	return(true);
+	bad: // it's broken (or we're out of memory); forget what we've got and parse it as if it wasn't there
+	for(k=0;k<(unsigned int)j->nmsgs;k++)
+		free(j->msgs[k].text);
+	free(j->msgs);
+	j->msgs=NULL;
+	j->nmsgs=j->nwarn=0;
+	for(k=0;k<(unsigned int)j->nentries;k++)
+		free(j->entries[k].matches);
+	free(j->entries);
+	j->entries=NULL;
+	j->nentries=0;
+	for(k=0;k<(unsigned int)j->nimports;k++)
+		free(j->imports[k]);
+	free(j->imports);
+	j->imports=NULL;
+	j->nimports=0;
+	miss:
+	unload_file(&cf);
+	return(false);
+}
+
+void cache_save(parse_job * j, css_file * mf)
+{
+	cache_hdr h={.size=mf->len, .hash=fnv64(mf->buf, mf->len, FNV64_BASIS), .mtime=mf->mtime, .mtimens=mf->mtimens, .nmsgs=j->nmsgs, .nwarn=j->nwarn, .nentries=j->nentries, .nimports=j->nimports};
+	memcpy(h.magic, CACHE_MAGIC, 8);
+	file_cache *fc=&j->cache;
+	int k, m;
+	cput(fc, &h, sizeof(h));
+	for(k=0;k<j->nmsgs;k++)
+	{
+		int tostdout=j->msgs[k].tostdout;
+		unsigned int len=strlen(j->msgs[k].text);
+		cput(fc, &j->msgs[k].warn, sizeof(int));
+		cput(fc, &tostdout, sizeof(int));
+		cput(fc, &len, sizeof(len));
+		cput(fc, j->msgs[k].text, len);
+	}
+	for(k=0;k<j->nentries;k++)
+	{
+		entry *e=&j->entries[k];
+		int v[5]={e->line, e->numlines, e->nmatches, e->innercode.off, e->innercode.len};
+		cput(fc, v, sizeof(v));
+		for(m=0;m<e->nmatches;m++)
+		{
+			int sp[2]={e->matches[m].off, e->matches[m].len};
+			cput(fc, sp, sizeof(sp));
+		}
+	}
+	for(k=0;k<j->nimports;k++)
+	{
+		unsigned int len=strlen(j->imports[k]);
+		cput(fc, &len, sizeof(len));
+		cput(fc, j->imports[k], len);
+	}
+}
+
+void cache_chains(file_cache * fc, selector * sels, arena * a)
+{
+	// the chains are saved as they were, atoms and all, followed by the strings of the atoms they used; so each atom has to be mapped to whatever it is this time
+	char *p=fc->blob, *end=fc->blob+fc->len;
+	unsigned int n, k, f, size, nnames;
+	if(!cget(&p, end, &n, sizeof(n)) || (n!=(unsigned int)fc->nsel))
+		return;
+	char **saved=(char **)calloc(max(n, 1), sizeof(char *)); // they aren't aligned in the blob, so they're only looked at once they've been copied out
+	atom *map=NULL;
+	unsigned int nmap=0;
+	if(!saved)
+		return;
+	for(k=0;k<n;k++)
+	{
+		if(!cget(&p, end, &size, sizeof(size)))
+			goto out;
+		if(!size) // it didn't parse, so it'll have to be parsed again to get its error
+			continue;
+		if((size<sizeof(sel_chain)) || (size>(size_t)(end-p)))
+			goto out;
+		saved[k]=p;
+		p+=size;
+	}
+	if(!cget(&p, end, &nnames, sizeof(nnames)))
+		goto out;
+	for(k=0;k<nnames;k++)
+	{
+		unsigned int old, len;
+		if(!cget(&p, end, &old, sizeof(old)) || !cget(&p, end, &len, sizeof(len)) || (len>(size_t)(end-p)) || !old)
+			goto out;
+		if(old>=nmap)
+		{
+			atom *nm=(atom *)realloc(map, (old+1)*sizeof(atom));
+			if(!nm)
+				goto out;
+			memset(nm+nmap, 0, (old+1-nmap)*sizeof(atom));
+			map=nm;
+			nmap=old+1;
+		}
+		if(!(map[old]=intern(p, len, true)))
+			goto out;
+		p+=len;
+	}
+	for(k=0;k<n;k++)
+	{
+		if(!saved[k])
+			continue;
+		memcpy(&size, saved[k]-sizeof(size), sizeof(size));
+		sel_chain *c=(sel_chain *)arena_alloc(a, size);
+		if(!c)
+			break;
+		memcpy(c, saved[k], size);
+		if(!chain_valid(c, size)) // (then the arena space is just wasted)
+			continue;
+		for(f=0;f<c->nselfs;f++)
+		{
+			atom old=CH_SELFS(c)[f].name;
+			if(old && ((old>=nmap) || !map[old]))
+				break;
+		}
+		if(f<c->nselfs)
+			continue;
+		for(f=0;f<c->nselfs;f++)
+		{
+			if(CH_SELFS(c)[f].name)
+				CH_SELFS(c)[f].name=map[CH_SELFS(c)[f].name];
+		}
+		sels[fc->sel0+k].chain=c;
+	}
+	out:
+	free(map);
+	free(saved);
+}
+bool chain_valid(sel_chain * c, size_t size)
+{
+	unsigned int f;
+	if((size<sizeof(sel_chain)) || (c->size!=size) || (size!=sizeof(sel_chain)+(unsigned long long)c->nselfs*sizeof(sel_elt3)+(unsigned long long)c->nsibs*sizeof(sel_elt2)+(unsigned long long)c->nelts*sizeof(sel_elt)))
+		return(false);
+	for(f=0;f<c->nelts;f++)
+	{
+		sel_elt *el=&CH_ELTS(c)[f];
+		if((el->sibs>c->nsibs) || (el->nsibs>c->nsibs-el->sibs))
+			return(false);
+	}
+	for(f=0;f<c->nsibs;f++)
+	{
+		sel_elt2 *sb=&CH_SIBS(c)[f];
+		if((sb->selfs>c->nselfs) || (sb->nselfs>c->nselfs-sb->selfs))
+			return(false);
+	}
+	return(true);
+}
+
+void cache_write(file_cache * fc, selector * sels)
+{
+	unsigned int n=fc->nsel, k, f, nnames=0, zero=0;
+	bool *used=(bool *)calloc(natoms+1, sizeof(bool));
+	if(!used)
+		return;
+	cput(fc, &n, sizeof(n));
+	for(k=0;k<n;k++)
+	{
+		sel_chain *c=sels[fc->sel0+k].chain;
+		if(!c)
+		{
+			cput(fc, &zero, sizeof(zero));
+			continue;
+		}
+		cput(fc, &c->size, sizeof(c->size));
+		cput(fc, c, c->size);
+		for(f=0;f<c->nselfs;f++)
+		{
+			atom name=CH_SELFS(c)[f].name;
+			if(name && !used[name])
+			{
+				used[name]=true;
+				nnames++;
+			}
+		}
+	}
+	cput(fc, &nnames, sizeof(nnames));
+	for(k=1;k<natoms;k++)
+	{
+		if(used[k])
+		{
+			unsigned int len=strlen(atoms[k]);
+			cput(fc, &k, sizeof(k));
+			cput(fc, &len, sizeof(len));
+			cput(fc, atoms[k], len);
+		}
+	}
+	free(used);
+	if(fc->bad)
+		return;
+	// write it under another name and rename() it into place, so another cssi never sees half of it
+	char tmp[strlen(fc->path)+24];
+	sprintf(tmp, "%s.%ld", fc->path, (long)getpid());
+	FILE *fp=fopen(tmp, "wb");
+	if(!fp)
+		return;
+	bool ok=(fwrite(fc->blob, 1, fc->len, fp)==fc->len);
+	if(fclose(fp) || !ok || rename(tmp, fc->path))
+		unlink(tmp);
+}
+
+int save_index(char * path, char ** filename, int nfiles, entry * entries, int nentries, selector * sort, int nsels, int nerrs)
+{
+	// Lay it out first, then write it in one pass: header, files, entries, sels, atom offsets, atomhash, atomrank, then the strings, images and chains (each 8-aligned)
+	#define IDX_ALIGN(n)	(((n)+7)&~(unsigned long long)7)
+	index_hdr h={.sizes={sizeof(index_hdr), sizeof(index_file), sizeof(entry), sizeof(index_sel), sizeof(sel_chain), sizeof(sel_elt)}, .nfiles=nfiles, .nentries=nentries, .nsels=nsels, .natoms=natoms, .atomhsize=atomhsize, .nerrs=nerrs};
+	memcpy(h.magic, INDEX_MAGIC, 8);
+	unsigned long long pos=IDX_ALIGN(sizeof(h));
+	h.files=pos;
+	pos=IDX_ALIGN(pos+nfiles*sizeof(index_file));
+	h.entries=pos;
+	pos=IDX_ALIGN(pos+nentries*sizeof(entry));
+	h.sels=pos;
+	pos=IDX_ALIGN(pos+nsels*sizeof(index_sel));
+	h.atoms=pos;
+	pos=IDX_ALIGN(pos+natoms*sizeof(unsigned long long));
+	h.atomhash=pos;
+	pos=IDX_ALIGN(pos+atomhsize*sizeof(unsigned int));
+	h.atomrank=pos;
+	pos=IDX_ALIGN(pos+natoms*sizeof(unsigned int));
+	int k;
+	char tmp[strlen(path)+24];
+	sprintf(tmp, "%s.%ld", path, (long)getpid());
+	FILE *fp=fopen(tmp, "wb");
+	if(!fp)
+		return(errno);
+	static const char zeros[8]={0};
+	unsigned long long at=0; // how much has been written
+	#define IDX_PUT(p, n)	(fwrite((p), 1, (n), fp), at+=(n))
+	#define IDX_PAD()	IDX_PUT(zeros, IDX_ALIGN(at)-at)
+	IDX_PUT(&h, sizeof(h));
+	IDX_PAD();
+	for(k=0;k<nfiles;k++) // the strings and images go after the tables, in this order
+	{
+		index_file f={.name=pos, .len=files[k].buf?files[k].len:0};
+		pos=IDX_ALIGN(pos+strlen(filename[k])+1);
+		if(files[k].buf)
+		{
+			f.buf=pos;
+			pos=IDX_ALIGN(pos+files[k].len+1);
+		}
+		IDX_PUT(&f, sizeof(f));
+	}
+	IDX_PAD();
+	for(k=0;k<nentries;k++)
+	{
+		entry e=entries[k];
+		e.matches=NULL;
+		IDX_PUT(&e, sizeof(e));
+	}
+	IDX_PAD();
+	for(k=0;k<nsels;k++)
+	{
+		index_sel is={.text=sort[k].text, .ent=sort[k].ent, .dup=sort[k].dup, .group=sort[k].group};
+		if(sort[k].chain)
+		{
+			is.chain=pos;
+			pos=IDX_ALIGN(pos+sort[k].chain->size);
+		}
+		IDX_PUT(&is, sizeof(is));
+	}
+	IDX_PAD();
+	for(k=0;k<(int)natoms;k++)
+	{
+		unsigned long long o=0;
+		if(atoms[k])
+		{
+			o=pos;
+			pos+=strlen(atoms[k])+1; // strings needn't be aligned
+		}
+		IDX_PUT(&o, sizeof(o));
+	}
+	IDX_PAD();
+	IDX_PUT(atomhash, atomhsize*sizeof(unsigned int));
+	IDX_PAD();
+	IDX_PUT(atomrank, natoms*sizeof(unsigned int));
+	IDX_PAD();
+	// now what the offsets point at, in the same order as they were handed out
+	for(k=0;k<nfiles;k++)
+	{
+		IDX_PUT(filename[k], strlen(filename[k])+1);
+		IDX_PAD();
+		if(files[k].buf)
+		{
+			IDX_PUT(files[k].buf, files[k].len);
+			IDX_PUT(zeros, 1);
+			IDX_PAD();
+		}
+	}
+	for(k=0;k<nsels;k++)
+	{
+		if(sort[k].chain)
+		{
+			IDX_PUT(sort[k].chain, sort[k].chain->size);
+			IDX_PAD();
+		}
+	}
+	for(k=0;k<(int)natoms;k++)
+	{
+		if(atoms[k])
+			IDX_PUT(atoms[k], strlen(atoms[k])+1);
+	}
+	#undef IDX_PUT
+	#undef IDX_PAD
+	#undef IDX_ALIGN
+	int e=ferror(fp)?(errno?errno:EIO):0;
+	if(fclose(fp) && !e)
+		e=errno;
+	if(!e && (at!=pos)) // the layout and the writing disagree; shouldn't happen
+		e=EIO;
+	if(!e && rename(tmp, path))
+		e=errno;
+	if(e)
+		unlink(tmp);
+	return(e);
+}
+
+int load_index(char * path, char *** filename, int * nfiles, entry ** entries, int * nentries, selector ** sort, int * nsels, int * nerrs)
+{
+	css_file f;
+	switch(load_file(path, &f)) // mmap()ed read-only where possible, so every cssi using the same index shares its pages
+	{
+		case 0:
+		break;
+		case 2:
+			return(2);
+		default:
+			return(1);
+	}
+	char *base=f.buf;
+	index_hdr h;
+	int rv=3;
+	char **names=NULL;
+	selector *sels=NULL;
+	// nothing in it is trusted till it's been checked: every offset has to fit in the file, and every index has to be in range of what it indexes
+	#define IDX_FITS(off, n)	(((off)<=f.len) && ((unsigned long long)(n)<=f.len-(off)))
+	#define IDX_SPAN(s)	(((unsigned int)(s).file<h.nfiles) && files[(s).file].buf && ((s).off>=0) && ((s).len>=0) && ((unsigned long long)(s).off+(s).len<=files[(s).file].len))
+	if((f.len<sizeof(h)) || ((unsigned long)base&7))
+		goto bad;
+	memcpy(&h, base, sizeof(h));
+	unsigned int sizes[6]={sizeof(index_hdr), sizeof(index_file), sizeof(entry), sizeof(index_sel), sizeof(sel_chain), sizeof(sel_elt)};
+	if(memcmp(h.magic, INDEX_MAGIC, 8) || memcmp(h.sizes, sizes, sizeof(sizes)) || !h.atomhsize || (h.atomhsize&(h.atomhsize-1)) || !h.natoms
+		|| ((h.files|h.entries|h.sels|h.atoms)&7) || ((h.atomhash|h.atomrank)&3)
+		|| !IDX_FITS(h.files, h.nfiles*sizeof(index_file)) || !IDX_FITS(h.entries, h.nentries*sizeof(entry)) || !IDX_FITS(h.sels, h.nsels*sizeof(index_sel))
+		|| !IDX_FITS(h.atoms, h.natoms*sizeof(unsigned long long)) || !IDX_FITS(h.atomhash, h.atomhsize*sizeof(unsigned int)) || !IDX_FITS(h.atomrank, h.natoms*sizeof(unsigned int))
+		|| (h.nfiles>INT_MAX) || (h.nentries>INT_MAX) || (h.nsels>INT_MAX))
+		goto bad;
+	unsigned int k, m, empty=0;
+	index_file *ifs=(index_file *)(base+h.files);
+	entry *ies=(entry *)(base+h.entries);
+	index_sel *iss=(index_sel *)(base+h.sels);
+	unsigned long long *ias=(unsigned long long *)(base+h.atoms);
+	unsigned int *iah=(unsigned int *)(base+h.atomhash);
+	names=(char **)malloc((h.nfiles+1)*sizeof(char *));
+	sels=(selector *)malloc((h.nsels+1)*sizeof(selector)); // copied out, as the index's index_sels aren't laid out as selectors
+	files=(css_file *)calloc(h.nfiles+1, sizeof(css_file));
+	atoms=(char **)malloc(h.natoms*sizeof(char *));
+	rv=2;
+	if(!(names && sels && files && atoms))
+		goto bad;
+	rv=3;
+	for(k=0;k<h.nfiles;k++)
+	{
+		if(!IDX_FITS(ifs[k].name, 1) || (ifs[k].buf && ((ifs[k].len>=f.len) || !IDX_FITS(ifs[k].buf, ifs[k].len+1))))
+			goto bad;
+		names[k]=base+ifs[k].name;
+		files[k].buf=ifs[k].buf?base+ifs[k].buf:NULL;
+		files[k].len=ifs[k].len;
+	}
+	for(k=0;k<h.nentries;k++) // snap_index() counts on them being in file order
+	{
+		if(((unsigned int)ies[k].file>=h.nfiles) || (k && (ies[k].file<ies[k-1].file)) || !IDX_SPAN(ies[k].innercode) || (ies[k].line<0) || (ies[k].numlines<0) || (ies[k].numlines>=INT_MAX-ies[k].line))
+			goto bad;
+	}
+	for(k=0;k<h.nsels;k++)
+	{
+		if(((unsigned int)iss[k].ent>=h.nentries) || ((unsigned int)iss[k].dup>=h.nsels) || !IDX_SPAN(iss[k].text))
+			goto bad;
+		sels[k]=(selector){.text=iss[k].text, .ent=iss[k].ent, .dup=iss[k].dup, .group=iss[k].group};
+		if(iss[k].chain)
+		{
+			if((iss[k].chain&7) || !IDX_FITS(iss[k].chain, sizeof(sel_chain)))
+				goto bad;
+			sel_chain *c=(sel_chain *)(base+iss[k].chain);
+			if(!IDX_FITS(iss[k].chain, c->size) || !chain_valid(c, c->size))
+				goto bad;
+			for(m=0;m<c->nselfs;m++)
+			{
+				if(CH_SELFS(c)[m].name>=h.natoms)
+					goto bad;
+			}
+			sels[k].chain=c;
+		}
+	}
+	atoms[0]=NULL;
+	for(k=1;k<h.natoms;k++)
+	{
+		if(!IDX_FITS(ias[k], 1))
+			goto bad;
+		atoms[k]=base+ias[k];
+	}
+	for(k=0;k<h.atomhsize;k++) // intern() looks up match= names in it, so it must only hold atoms, and must have a gap to stop at
+	{
+		if(iah[k]>=h.natoms)
+			goto bad;
+		if(!iah[k])
+			empty++;
+	}
+	if(!empty)
+		goto bad;
+	#undef IDX_SPAN
+	#undef IDX_FITS
+	natoms=h.natoms;
+	atomhash=iah; // intern() only reads it, since match= trees never add
+	atomhsize=h.atomhsize;
+	atomrank=(unsigned int *)(base+h.atomrank);
+	*filename=names;
+	*nfiles=h.nfiles;
+	*entries=ies;
+	*nentries=h.nentries;
+	*sort=sels;
+	*nsels=h.nsels;
+	*nerrs=h.nerrs;
+	return(0);
+	bad:
+	free(names);
+	free(sels);
+	free(files);
+	free(atoms);
+	files=NULL;
+	atoms=NULL;
+	unload_file(&f);
+	return(rv);
+}
+
+void cput(file_cache * fc, const void * src, size_t len)
+{
+	if(fc->bad)
+		return;
+	if(fc->len+len>fc->cap)
+	{
+		size_t ncap=max(fc->cap*2, fc->len+len+4096);
+		char *nb=(char *)realloc(fc->blob, ncap);
+		if(!nb)
+		{
+			fc->bad=true;
+			return;
+		}
+		fc->blob=nb;
+		fc->cap=ncap;
+	}
+	memcpy(fc->blob+fc->len, src, len);
+	fc->len+=len;
+}
+
+bool cget(char ** p, char * end, void * dst, size_t len)
+{
+	if(len>(size_t)(end-*p))
+		return(false);
+	memcpy(dst, *p, len);
+	*p+=len;
+	return(true);
+}
+
+void jvprintf(parse_job * j, FILE * fp, int warn, const char * fmt, va_list ap)
+{
+	if(!j) // not being saved up
+	{
+		vfprintf(fp, fmt, ap);
+		return;
+	}
+	va_list aq;
+	va_copy(aq, ap);
+	int len=vsnprintf(NULL, 0, fmt, aq);
+	va_end(aq);
+	char *text=(char *)malloc(len+1);
+	jmsg *msgs=(jmsg *)realloc(j->msgs, (j->nmsgs+1)*sizeof(jmsg));
+	if(!(text && msgs)) // nothing we can do about it; the message is lost
+	{
+		free(text);
+		if(msgs)
+			j->msgs=msgs;
+		return;
+	}
+	vsnprintf(text, len+1, fmt, ap);
+	j->msgs=msgs;
+	j->msgs[j->nmsgs++]=(jmsg){text, fp==stdout, warn};
+}
+
+void jprintf(parse_job * j, FILE * fp, const char * fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	jvprintf(j, fp, 0, fmt, ap);
+	va_end(ap);
+}
+
+void jwprintf(parse_job * j, FILE * fp, const char * fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	jvprintf(j, fp, j->nwarn, fmt, ap);
+	va_end(ap);
+}
+
+bool jwarn(parse_job * j)
+{
+	j->nwarn++;
+	return(true);
+}
+
+// reads the whole of the named file ("-" means stdin) into one contiguous buffer
+// Regular files are mmap()ed; anything else (pipes, ttys...) is streamed into a malloc()ed buffer
+int load_file(char * name, css_file * f)
+{
+	f->buf=NULL;
+	f->len=0;
+	f->mapped=false;
+	f->nlines=0;
+	f->lines=NULL;
+	bool isstdin=(strcmp(name, "-")==0);
+	int fd=isstdin?STDIN_FILENO:open(name, O_RDONLY);
+	if(fd<0)
+		return(1);
+	struct stat st;
+	if(fstat(fd, &st))
+	{
+		if(!isstdin) close(fd);
+		return(1);
+	}
+	f->mtime=st.st_mtime;
+	f->mtimens=ST_MTIME_NS(st);
+#ifndef _WIN32
+	if(S_ISREG(st.st_mode) && (st.st_size>0) && !watch) // (an editor may rewrite a watched file in place, which would change or even truncate the mapping under us)
+	{
+		// Map an anonymous region one page longer than we need, then map the file over the front of it.
+		// That way there's always a zero-filled page (or the zeroed tail of the file's last page) after the data, so the parser can look one char ahead without checking for EOF
+		size_t pg=sysconf(_SC_PAGESIZE);
+		size_t maplen=(st.st_size/pg+1)*pg;
+		char *base=mmap(NULL, maplen, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if(base!=MAP_FAILED)
+		{
+			if(mmap(base, st.st_size, PROT_READ, MAP_PRIVATE|MAP_FIXED, fd, 0)!=MAP_FAILED)
 			{
-				if(daemonmode)
-					printf("ERR:EBADCMD:\"%s\"\n", cmd);
-				else
-					fprintf(output, "cssi: Error: unrecognised command %s!\n", cmd);
+				close(fd);
+				f->buf=base;
+				f->len=st.st_size;
+				f->mapped=true;
+				return(0);
 			}
+			munmap(base, maplen);
+		}
+		// if mmap() didn't work, fall back on reading it in
+	}
+#endif
+	size_t size=65536;
+	char *buf=(char *)malloc(size);
+	while(buf)
+	{
+		ssize_t e=read(fd, buf+f->len, size-f->len-1);
+		if(e<0)
+		{
+			if(errno==EINTR)
+				continue;
+			free(buf);
+			if(!isstdin) close(fd);
+			return(1);
+		}
+		if(e==0)
+			break;
+		f->len+=e;
+		if(f->len+1==size)
+		{
+			char *nbuf=(char *)realloc(buf, size*=2);
+			if(!nbuf)
+				free(buf);
+			buf=nbuf;
 		}
-		if(parmv)
-			free(parmv);
-		if(input)
-			free(input);
 	}
+	if(!isstdin) close(fd);
+	if(!buf)
+		return(2);
+	buf[f->len]=0;
+	f->buf=buf;
 	return(0);
 }
 
-/* WARNING, this fgetl() is not like my usual getl(); this one keeps the \n */
-// gets a line of string data, {re}alloc()ing as it goes, so you don't need to make a buffer for it, nor must thee fret thyself about overruns!
-char * fgetl(FILE *fp)
+void unload_file(css_file * f)
 {
-	char * lout = (char *)malloc(81);
-	int i=0;
-	signed int c;
-	while(!feof(fp))
+	if(f->buf)
 	{
-		c=fgetc(fp);
-		if(c==EOF)
-			break;
-		if(c!=0)
+#ifndef _WIN32
+		if(f->mapped)
 		{
-			lout[i++]=c;
-			if((i%80)==0)
-			{
-				if((lout=(char *)realloc(lout, i+81))==NULL)
-				{
-					printf("\nNot enough memory to store input!\n");
-					free(lout);
-					return(NULL);
-				}
-			}
+			size_t pg=sysconf(_SC_PAGESIZE);
+			munmap(f->buf, (f->len/pg+1)*pg);
 		}
-		if(c=='\n') // we do want to keep them this time
-			break;
+		else
+#endif
+			free(f->buf);
 	}
-	lout[i]=0;
-	char *nlout=(char *)realloc(lout, i+1);
-	if(nlout==NULL)
+	f->buf=NULL;
+	free(f->lines);
+	f->lines=NULL;
+	f->nlines=0;
+}
+
+// The line index is only needed for error messages (and tracing), so we don't build it until someone asks
+size_t line_start(css_file * f, int line)
+{
+	if(!f->lines)
 	{
-		return(lout); // it doesn't really matter (assuming realloc is a decent implementation and hasn't nuked the original pointer), we'll just have to temporarily waste a bit of memory
+		size_t off;
+		int n=1;
+		for(off=0;off<f->len;off++)
+			if(f->buf[off]=='\n') n++;
+		if(!(f->lines=(size_t *)malloc(n*sizeof(size_t))))
+			return(0); // we'll print the wrong context, but we were only going to print an error anyway
+		f->lines[0]=0;
+		f->nlines=1;
+		for(off=0;off<f->len;off++)
+			if(f->buf[off]=='\n')
+				f->lines[f->nlines++]=off+1;
 	}
-	return(nlout);
+	if((line<0) || (line>=f->nlines))
+		return(f->len);
+	return(f->lines[line]);
+}
+
+int lcol(css_file * f, int line, size_t off)
+{
+	return(off-line_start(f, line));
+}
+
+int llen(css_file * f, int line)
+{
+	size_t start=line_start(f, line);
+	char *eol=memchr(f->buf+start, '\n', f->len-start);
+	return(eol?(eol-f->buf)-start+1:f->len-start);
 }
 
 char * getl(char * prompt)
@@ -850,81 +3695,275 @@ char * getl(char * prompt)
 	return(nlout);
 }
 
-// Sorts by sel_elt * chain, so you MUST parse_selector() first! (else they'll all be NULL so they'll all compare equal)
-selector * selmergesort(selector * array, int len)
+// Comments (and stray NULs) are left in the file image, so we take them out here.  If sel, runs of whitespace are also squashed to a single space, and leading & trailing whitespace is dropped
+int spantext(span s, char * buf, FILE * fp, bool sel)
+{
+	char *src=files[s.file].buf+s.off;
+	int i, len=0;
+	bool white=false;
+	for(i=0;i<s.len;i++)
+	{
+		char c=src[i];
+		if((c=='/') && (i+1<s.len) && (src[i+1]=='*'))
+		{
+			for(i+=2;(i+1<s.len) && !((src[i]=='*') && (src[i+1]=='/'));i++);
+			i++; // leaves us on the '/', which the for() then steps over
+			continue;
+		}
+		if(!c)
+			continue;
+		if(sel && strchr(" \t\n\r\f", c))
+		{
+			white=len; // never at the start of the string
+			continue;
+		}
+		if(white)
+		{
+			if(buf) buf[len]=' '; else fputc(' ', fp);
+			len++;
+			white=false;
+		}
+		if(buf) buf[len]=c; else fputc(c, fp);
+		len++;
+	}
+	if(buf)
+		buf[len]=0;
+	return(len);
+}
+
+// Sorts by sel_chain * chain, so you MUST parse_selector() and rank_atoms() first! (else they'll all be NULL so they'll all compare equal)
+// Each chain is flattened to a key (see selkey()) which compares word by word in the same order as treecmp; we merge sort indices (bottom-up, stable), then copy the selectors once
+selector * selsort(selector * array, int len)
 {
 	if(len<1)
 		return(NULL);
 	selector *rv=(selector *)malloc(len*sizeof(selector));
-	switch(len)
+	unsigned int *koff=(unsigned int *)malloc(len*sizeof(unsigned int)), *klen=(unsigned int *)malloc(len*sizeof(unsigned int));
+	unsigned long long *kpre=(unsigned long long *)malloc(len*sizeof(unsigned long long)); // first two words of the key, so most comparisons are one compare
+	int *idx=(int *)malloc(len*sizeof(int)), *tmp=(int *)malloc(len*sizeof(int));
+	unsigned int *keys=NULL;
+	size_t nkeys=0;
+	int i;
+	if(rv && koff && klen && kpre && idx && tmp)
 	{
-		case 1:
-			rv[0]=array[0];
-			return(rv);
-		break;
-		case 2:
-			if(treecmp(array[0].chain, array[1].chain)<=0)
-			{
-				rv[0]=array[0];
-				rv[1]=array[1];
-			}
+		for(i=0;i<len;i++)
+			nkeys+=selkey(array[i].chain, NULL);
+		keys=(unsigned int *)malloc((nkeys+1)*sizeof(unsigned int));
+	}
+	if(!keys)
+	{
+		free(rv);free(koff);free(klen);free(kpre);free(idx);free(tmp);
+		return(NULL);
+	}
+	nkeys=0;
+	for(i=0;i<len;i++)
+	{
+		koff[i]=nkeys;
+		klen[i]=selkey(array[i].chain, keys+nkeys);
+		kpre[i]=((unsigned long long)(klen[i]>0?keys[nkeys]:0)<<32)|(klen[i]>1?keys[nkeys+1]:0);
+		nkeys+=klen[i];
+		idx[i]=i;
+	}
+	int nblocks=max(min(nthreads, len/SELS_MIN), 1), width=1, w;
+	while(width*nblocks<len) // the blocks must be whole runs, so that they merge as if it had all been done in one go
+		width*=2;
+	nblocks=(len+width-1)/width;
+	sort_ctx ctx[nblocks];
+	for(i=0;i<nblocks;i++)
+		ctx[i]=(sort_ctx){.keys=keys, .koff=koff, .klen=klen, .kpre=kpre, .idx=idx, .tmp=tmp, .lo=i*width, .hi=min((i+1)*width, len), .width=width};
+#ifndef _WIN32
+	pthread_t th[nblocks];
+	bool threaded[nblocks];
+	for(i=1;i<nblocks;i++)
+		threaded[i]=!pthread_create(&th[i], NULL, sort_block, &ctx[i]);
+#endif
+	sort_block(&ctx[0]);
+	for(i=1;i<nblocks;i++)
+	{
+#ifndef _WIN32
+		if(threaded[i])
+			pthread_join(th[i], NULL);
+		else
+#endif
+			sort_block(&ctx[i]);
+	}
+	for(w=1;w<width;w*=2) // every block made the same number of passes, so they all ended up in the same buffer
+	{
+		int *t=idx;idx=tmp;tmp=t;
+	}
+	for(w=width;w<len;w*=2) // and then merge the blocks
+	{
+		merge_pass(&ctx[0], idx, tmp, w, 0, len);
+		int *t=idx;idx=tmp;tmp=t;
+	}
+	for(i=0;i<len;i++)
+		rv[i]=array[idx[i]];
+	free(koff);free(klen);free(kpre);free(idx);free(tmp);free(keys);
+	return(rv);
+}
+
+void * sort_block(void * arg)
+{
+	sort_ctx *c=(sort_ctx *)arg;
+	int *from=c->idx, *to=c->tmp, w;
+	for(w=1;w<c->width;w*=2) // merge runs of w into runs of 2w, ping-ponging between idx and tmp
+	{
+		merge_pass(c, from, to, w, c->lo, c->hi);
+		int *t=from;from=to;to=t;
+	}
+	return(NULL);
+}
+
+void merge_pass(sort_ctx * c, int * from, int * to, int w, int lo, int hi)
+{
+	unsigned int *keys=c->keys, *koff=c->koff, *klen=c->klen;
+	unsigned long long *kpre=c->kpre;
+	int start;
+	for(start=lo;start<hi;start+=2*w)
+	{
+		int mid=min(start+w, hi), end=min(start+2*w, hi);
+		int p=start, q=mid, j=start;
+		while(j<end)
+		{
+			bool left;
+			if(p==mid)
+				left=false;
+			else if(q==end)
+				left=true;
 			else
 			{
-				rv[0]=array[1];
-				rv[1]=array[0];
-			}
-			return(rv);
-		break;
-		default:
-			;
-			int i=len/2;
-			selector *left=(selector *)malloc(i*sizeof(selector));
-			selector *right=(selector *)malloc((len-i)*sizeof(selector));
-			int j;
-			for(j=0;j<len;j++)
-			{
-				if(j<i)
-					left[j]=array[j];
+				int a=from[p], b=from[q];
+				if(kpre[a]!=kpre[b])
+					left=kpre[a]<kpre[b];
 				else
-					right[j-i]=array[j];
+				{
+					unsigned int k, n=min(klen[a], klen[b]);
+					for(k=2;(k<n)&&(keys[koff[a]+k]==keys[koff[b]+k]);k++);
+					left=(k<n)?(keys[koff[a]+k]<keys[koff[b]+k]):(klen[a]<=klen[b]);
+				}
 			}
-			selector *sleft=selmergesort(left, i);
-			selector *sright=selmergesort(right, len-i);
-			free(left);
-			free(right);
-			int p=0,q=0;
-			for(j=0;j<len;j++)
+			to[j++]=left?from[p++]:from[q++];
+		}
+	}
+}
+
+int selcmp(selector * a, selector * b)
+{
+	// the keys are walked rather than built, as a long selector's would overflow the stack (and this runs on the watcher thread, in reload_file())
+	unsigned int na=selkey(a->chain, NULL), nb=selkey(b->chain, NULL), k;
+	key_cursor ca={a->chain}, cb={b->chain};
+	for(k=0;(k<na)&&(k<nb);k++)
+	{
+		unsigned int wa=key_next(&ca), wb=key_next(&cb);
+		if(wa!=wb)
+			return((wa>wb)-(wa<wb));
+	}
+	if(na!=nb)
+		return((na>nb)-(na<nb));
+	if(a->ent!=b->ent)
+		return((a->ent>b->ent)-(a->ent<b->ent));
+	return((a->text.off>b->text.off)-(a->text.off<b->text.off));
+}
+
+// Writes c's sort key into key (if not NULL) and returns its length in words.  For each elt: for each sibling, (2+type, rank) for each of its selfs then KEY_END_SELFS; then KEY_END_SIBS; then 0 for the last elt, else 1+nextrel
+unsigned int selkey(sel_chain * c, unsigned int * key)
+{
+	if(!c)
+		return(0);
+	unsigned int n=2*c->nelts+c->nsibs+2*c->nselfs;
+	if(!key)
+		return(n);
+	unsigned int e, s, f, k=0;
+	for(e=0;e<c->nelts;e++)
+	{
+		sel_elt *el=&CH_ELTS(c)[e];
+		for(s=el->sibs;s<el->sibs+el->nsibs;s++)
+		{
+			sel_elt2 *sb=&CH_SIBS(c)[s];
+			for(f=sb->selfs;f<sb->selfs+sb->nselfs;f++)
 			{
-				if(p==i)
+				key[k++]=2+CH_SELFS(c)[f].type;
+				key[k++]=atomrank[CH_SELFS(c)[f].name];
+			}
+			key[k++]=KEY_END_SELFS;
+		}
+		key[k++]=KEY_END_SIBS;
+		key[k++]=(e+1<c->nelts)?1+el->nextrel:0;
+	}
+	return(k);
+}
+
+unsigned int key_next(key_cursor * kc)
+{
+	sel_chain *c=kc->c;
+	for(;;)
+	{
+		sel_elt *el=&CH_ELTS(c)[kc->e];
+		switch(kc->step)
+		{
+			case 0: // the start of an elt
+				kc->s=el->sibs;
+				kc->step=1;
+			break;
+			case 1: // the start of a sibling, or past the last
+				if(kc->s<el->sibs+el->nsibs)
 				{
-					rv[j]=sright[q++];
+					kc->f=CH_SIBS(c)[kc->s].selfs;
+					kc->step=2;
 				}
-				else if(q==len-i)
+				else
 				{
-					rv[j]=sleft[p++];
+					kc->step=4;
+					return(KEY_END_SIBS);
 				}
-				else
+			break;
+			case 2: // a self's type, or past the last
+				if(kc->f<CH_SIBS(c)[kc->s].selfs+CH_SIBS(c)[kc->s].nselfs)
 				{
-					if(treecmp(sleft[p].chain, sright[q].chain)<=0)
-					{
-						rv[j]=sleft[p++];
-					}
-					else
-					{
-						rv[j]=sright[q++];
-					}
+					kc->step=3;
+					return(2+CH_SELFS(c)[kc->f].type);
 				}
-			}
-			free(sleft);
-			free(sright);
-			return(rv);
-		break;
+				kc->s++;
+				kc->step=1;
+				return(KEY_END_SELFS);
+			case 3: // its name
+				kc->step=2;
+				return(atomrank[CH_SELFS(c)[kc->f++].name]);
+			default: // how it relates to the next elt
+				kc->e++;
+				kc->step=0;
+				return((kc->e<c->nelts)?1+el->nextrel:0);
+		}
 	}
 }
 
-int parse_selector(selector * s, int sid)
+int parse_selector(selector * s, char * text, int sid, arena * a, parse_job * j)
 {
 	s->chain=NULL; // initially empty
+	// the chain is built up in these, then copied into the arena in one piece once we know how big it is; a long selector's would overflow the stack, so those go on the heap
+	int len=strlen(text), rv;
+	size_t need=(len+1)*(sizeof(sel_elt)+2*sizeof(sel_elt2)+sizeof(sel_elt3)+1);
+	unsigned long long small[1024]; // (for the alignment)
+	char *buf=(need<=sizeof(small))?(char *)small:(char *)malloc(need);
+	if(!buf)
+	{
+		jprintf(j, output, "cssi: Error: Failed to alloc mem for parsing a selector.\n");
+		if(daemonmode)
+			jprintf(j, stdout, "ERR:EMEM\n");
+		return(1);
+	}
+	sel_elt *elts=(sel_elt *)buf;
+	sel_elt2 *sibs=(sel_elt2 *)(elts+len+1); // a '+' can start two at once
+	sel_elt3 *selfs=(sel_elt3 *)(sibs+2*len+2);
+	rv=parse_selector_real(s, text, sid, a, j, elts, sibs, selfs, (char *)(selfs+len+1));
+	if(buf!=(char *)small)
+		free(buf);
+	return(rv);
+}
+
+int parse_selector_real(selector * s, char * text, int sid, arena * a, parse_job * j, sel_elt * elts, sel_elt2 * sibs, sel_elt3 * selfs, char * name)
+{
+	int nelts=0, nsibs=0, nselfs=0;
 	// state machine
 	int state=0;
 	int pos=0;
@@ -932,130 +3971,85 @@ int parse_selector(selector * s, int sid)
 	char *cstr=NULL;
 	int cstl=0;
 	bool desc=false;
-	sel_elt *chld=NULL;
-	sel_elt2 *sblg=NULL;
-	sel_elt3 *self=NULL;
+	int chld=-1, sblg=-1; // the elts we're currently adding to; -1 means we haven't got one yet
 	seltype type=NONE;
 	bool igwhite=false;
-	while(*(curr=s->text+pos) || state) // assigns curr to the current position, then checks the char there is not '\0' - if it is, and state=0, then stop
+	while(*(curr=text+pos) || state) // assigns curr to the current position, then checks the char there is not '\0' - if it is, and state=0, then stop
 	{
 		if(trace)
-			fprintf(stderr, "%d\t%d\t%hhu\t'%c'\t%p,%p,%p\t%s\n", state, pos+1, *curr, *curr, chld, sblg, self, cstr);
+			fprintf(stderr, "%d\t%d\t%hhu\t'%c'\t%d,%d,%d\t%s\n", state, pos+1, *curr, *curr, chld, sblg, nselfs, cstr);
 		switch(state)
 		{
 			case 0: // get an identifier
-				if(*curr=='.')
-				{
-					if(desc && chld)
-					{
-						sel_elt * next=(sel_elt *)malloc(sizeof(sel_elt));
-						next->prev=chld;
-						chld->nextrel=DESC;
-						chld=chld->next=next;
-						chld->next=NULL;
-						sblg=chld->sibs=NULL;
-						self=NULL;
-						desc=false;
-					}
-					pos++;
-					state=1;
-					type=CLASS;
-					cstr=NULL;cstl=0;
-				}
-				else if(*curr==':')
+				if(strchr(".:#*", *curr))
 				{
-					if(desc && chld)
+					if(desc && (chld>=0))
 					{
-						sel_elt * next=(sel_elt *)malloc(sizeof(sel_elt));
-						next->prev=chld;
-						chld->nextrel=DESC;
-						chld=chld->next=next;
-						chld->next=NULL;
-						sblg=chld->sibs=NULL;
-						self=NULL;
+						elts[chld].nextrel=DESC;
+						chld=nelts++;
+						elts[chld]=(sel_elt){nsibs, 0, DESC};
+						sblg=-1;
 						desc=false;
 					}
-					pos++;
-					state=1;
-					type=PCLASS;
-					cstr=NULL;cstl=0;
-				}
-				else if(*curr=='#')
-				{
-					if(desc && chld)
-					{
-						sel_elt * next=(sel_elt *)malloc(sizeof(sel_elt));
-						next->prev=chld;
-						chld->nextrel=DESC;
-						chld=chld->next=next;
-						chld->next=NULL;
-						sblg=chld->sibs=NULL;
-						self=NULL;
-						desc=false;
-					}
-					pos++;
-					state=1;
-					type=ID;
-					cstr=NULL;cstl=0;
-				}
-				else if(*curr=='*')
-				{
-					if(desc && chld)
+					switch(*curr)
 					{
-						sel_elt * next=(sel_elt *)malloc(sizeof(sel_elt));
-						next->prev=chld;
-						chld->nextrel=DESC;
-						chld=chld->next=next;
-						chld->next=NULL;
-						sblg=chld->sibs=NULL;
-						self=NULL;
-						desc=false;
+						case '.':
+							type=CLASS;
+							state=1;
+						break;
+						case ':':
+							type=PCLASS;
+							state=1;
+						break;
+						case '#':
+							type=ID;
+							state=1;
+						break;
+						case '*':
+							type=UNIV;
+							cstr=NULL;
+							state=2;
+						break;
 					}
-					type=UNIV;
-					cstr=NULL;
-					state=2;
 					pos++;
 				}
 				else if(strchr(" \t\n\r\f", *curr)) // whitespace (though \n should /not/ happen)
 				{
-					if(chld && !igwhite) // ignore ws at the beginning of a sel or after a > or + (or suchlike)
+					if((chld>=0) && !igwhite) // ignore ws at the beginning of a sel or after a > or + (or suchlike)
 						desc=true;
 					pos++;
 				}
 				else if(*curr=='>')
 				{
-					sel_elt * next=(sel_elt *)malloc(sizeof(sel_elt));
-					if(!chld)
+					if(chld<0)
 					{
-						s->chain=chld=(sel_elt *)malloc(sizeof(sel_elt));
-						chld->prev=NULL;
-						chld->sibs=NULL;
+						chld=nelts++;
+						elts[chld]=(sel_elt){nsibs, 0, DESC};
 					}
-					next->prev=chld;
-					chld->nextrel=CHLD;
-					chld=chld->next=next;
-					chld->next=NULL;
-					sblg=chld->sibs=NULL;
-					self=NULL;
+					elts[chld].nextrel=CHLD;
+					chld=nelts++;
+					elts[chld]=(sel_elt){nsibs, 0, DESC};
+					sblg=-1;
 					desc=false;
 					pos++;
 					igwhite=true; // ' > ' is like '>', not ' '.
 				}
 				else if(*curr=='+')
 				{
-					sel_elt2 * next=(sel_elt2 *)malloc(sizeof(sel_elt2));
-					if(!sblg)
+					if(chld<0) // nothing for it to be a sibling of, so it's "*+"
+					{
+						chld=nelts++;
+						elts[chld]=(sel_elt){nsibs, 0, DESC};
+					}
+					if(sblg<0)
 					{
-						chld->sibs=sblg=(sel_elt2 *)malloc(sizeof(sel_elt2));
-						sblg->next=NULL;
-						sblg->prev=NULL;
-						sblg->selfs=NULL;
+						sblg=nsibs++;
+						sibs[sblg]=(sel_elt2){nselfs, 0};
+						elts[chld].nsibs++;
 					}
-					next->prev=sblg;
-					sblg->nextrel=SBLG;
-					sblg=sblg->next=next;
-					sblg->next=NULL;
-					self=sblg->selfs=NULL;
+					sblg=nsibs++;
+					sibs[sblg]=(sel_elt2){nselfs, 0};
+					elts[chld].nsibs++;
 					desc=false;
 					pos++;
 					igwhite=true; // ' + ' is like '+', not ' '.
@@ -1067,271 +4061,542 @@ int parse_selector(selector * s, int sid)
 				}
 			break;
 			case 1: // read a string until the next identifier-delimiter
-				if(strchr(":.#[ >+", *curr) || !*curr) // is it time to end the string?
-				{
-					cstr=(char *)realloc(cstr, ++cstl);
-					cstr[cstl-1]=0;
-					state=2;
-				}
-				else
-				{
-					cstr=(char *)realloc(cstr, ++cstl+1);
-					cstr[cstl-1]=*curr;
-					cstr[cstl]=0;
-					pos++;
-				}
+				cstl=strcspn(curr, ":.#[ >+"); // also stops at the '\0'
+				cstr=name;
+				memcpy(cstr, curr, cstl);
+				cstr[cstl]=0;
+				pos+=cstl;
+				state=2;
 			break;
 			case 2: // have read name
 				if(type==NONE)
 				{
 					if(!(cstr && cstr[0]))
 					{
-						fprintf(output, SPARSERR"\tEmpty selent\n", SPARSARG);
-						fprintf(output, SPMKLINE);
+						jprintf(j, output, SPARSERR"\tEmpty selent\n", SPARSARG);
+						jprintf(j, output, SPMKLINE);
 						if(daemonmode)
-							printf(DSPARSERR"empty selent\n", DSPARSARG);
-						tree_free(s->chain);
+							jprintf(j, stdout, DSPARSERR"empty selent\n", DSPARSARG);
 						return(1);
 					}
-					int i;
-					for(i=0;i<ntags;i++)
-					{
-						if(strcmp(cstr, tags[i])==0)
-						{
-							type=TAG;
-							break;
-						}
-					}
-					if(type==NONE)
+					if(tag_lookup(cstr, cstl, false)>=0)
+						type=TAG;
+					else
 					{
-						fprintf(output, SPARSERR"\tUnrecognised identifier '%s'\n", SPARSARG, cstr);
-						fprintf(output, SPMKLINE);
+						jprintf(j, output, SPARSERR"\tUnrecognised identifier '%s'\n", SPARSARG, cstr);
+						jprintf(j, output, SPMKLINE);
 						if(daemonmode)
-							printf(DSPARSERR"unrecognised identifier\n", DSPARSARG);
-						tree_free(s->chain);
+							jprintf(j, stdout, DSPARSERR"unrecognised identifier\n", DSPARSARG);
 						return(1);
 					}
 				}
-				//fprintf(stderr, "chld %p, sblg %p, self %p, sself %p\n", chld, sblg, self, sblg?sblg->selfs:NULL);
-				if(desc&&chld)
-				{
-					sel_elt * next=(sel_elt *)malloc(sizeof(sel_elt));
-					next->prev=chld;
-					chld->nextrel=DESC;
-					chld=chld->next=next;
-					chld->next=NULL;
-					sblg=chld->sibs=NULL;
-					self=NULL;
-				}
-				//fprintf(stderr, "chld %p, sblg %p, self %p, sself %p\n", chld, sblg, self, sblg?sblg->selfs:NULL);
-				if(!chld)
+				if(desc && (chld>=0))
 				{
-					s->chain=chld=(sel_elt *)malloc(sizeof(sel_elt));
-					chld->prev=NULL;
-					chld->next=NULL;
-					sblg=chld->sibs=NULL;
-					self=NULL;
+					elts[chld].nextrel=DESC;
+					chld=nelts++;
+					elts[chld]=(sel_elt){nsibs, 0, DESC};
+					sblg=-1;
 				}
-				//fprintf(stderr, "chld %p, sblg %p, self %p, sself %p\n", chld, sblg, self, sblg?sblg->selfs:NULL);
-				if(!sblg)
+				if(chld<0)
 				{
-					sblg=chld->sibs=(sel_elt2 *)malloc(sizeof(sel_elt2));
-					sblg->next=NULL;
-					sblg->prev=NULL;
-					self=sblg->selfs=NULL;
+					chld=nelts++;
+					elts[chld]=(sel_elt){nsibs, 0, DESC};
+					sblg=-1;
 				}
-				//fprintf(stderr, "chld %p, sblg %p, self %p, sself %p\n", chld, sblg, self, sblg?sblg->selfs:NULL);
-				if(!self)
+				if(sblg<0)
 				{
-					self=sblg->selfs=(sel_elt3 *)malloc(sizeof(sel_elt3));
+					sblg=nsibs++;
+					sibs[sblg]=(sel_elt2){nselfs, 0};
+					elts[chld].nsibs++;
 				}
-				else
+				atom n=ATOM_NONE;
+				if(cstr)
 				{
-					self=self->next=(sel_elt3 *)malloc(sizeof(sel_elt3));
+					if(sid<0 && (cstr[0]=='?'))
+						n=ATOM_ANY;
+					else
+						n=intern(cstr, cstl, sid>=0); // in a match= tree, ATOM_NONE means no stylesheet uses it, so it can't match
 				}
-				//fprintf(stderr, "chld %p, sblg %p, self %p, sself %p\n", chld, sblg, self, sblg?sblg->selfs:NULL);
-				self->type=type;
-				self->data=cstr;
-				self->next=NULL; // until (and if) we get one
+				selfs[nselfs++]=(sel_elt3){type, n};
+				sibs[sblg].nselfs++;
 				cstr=NULL;cstl=0; // disconnect the pointer
 				state=0; // return to reading-state
 				igwhite=false;
 				desc=false;
 			break;
 			default:
-				fprintf(output, SPARSERR"\tNo such state!\n", SPARSARG);
-				fprintf(output, SPMKLINE);
+				jprintf(j, output, SPARSERR"\tNo such state!\n", SPARSARG);
+				jprintf(j, output, SPMKLINE);
 				if(daemonmode)
-					printf(DSPARSERR"no such state\n", DSPARSARG);
-				tree_free(s->chain);
+					jprintf(j, stdout, DSPARSERR"no such state\n", DSPARSARG);
 				return(1);
 			break;
 		}
 	}
-	chld=s->chain;
-	while(chld)
-	{
-		sblg=chld->sibs;
-		while(sblg && sblg->next) sblg=sblg->next;
-		chld->last=sblg;
-		//fprintf(stderr, "chld %p, last %p, self %p\n", chld, chld->last, chld->last->selfs);
-		chld=chld->next;
-	}
-	return(0);
+	// each elt's sibs, and each sib's selfs, were added contiguously, so the indices are already right
+	int k;
+	for(k=0;k<nsibs;k++) // put each compound in canonical order, so that eg. ".a.b" and ".b.a" are the same chain
+	{
+		sel_elt3 *f=selfs+sibs[k].selfs;
+		int m, n=sibs[k].nselfs;
+		for(m=1;m<n;m++) // insertion sort; compounds are short
+		{
+			sel_elt3 t=f[m];
+			int j;
+			for(j=m;(j>0)&&(selfcmp(&f[j-1], &t)>0);j--)
+				f[j]=f[j-1];
+			f[j]=t;
+		}
+	}
+	unsigned int size=sizeof(sel_chain)+nselfs*sizeof(sel_elt3)+nsibs*sizeof(sel_elt2)+nelts*sizeof(sel_elt);
+	sel_chain *c=(sel_chain *)arena_alloc(a, size);
+	if(!c)
+		return(1);
+	c->size=size;
+	c->nelts=nelts;
+	c->nsibs=nsibs;
+	c->nselfs=nselfs;
+	memcpy(CH_SELFS(c), selfs, nselfs*sizeof(sel_elt3));
+	memcpy(CH_SIBS(c), sibs, nsibs*sizeof(sel_elt2));
+	memcpy(CH_ELTS(c), elts, nelts*sizeof(sel_elt));
+	c->fp=chain_fp(c);
+	s->chain=c;
+	return(0);
+}
+
+unsigned long long chain_fp(sel_chain * c)
+{
+	unsigned long long h=14695981039346656037ull; // FNV-1a, over the same stream as selkey() but with names in place of ranks
+	unsigned int e, s, f;
+	#define FP_BYTE(b)	h=(h^(unsigned char)(b))*1099511628211ull
+	for(e=0;e<c->nelts;e++)
+	{
+		sel_elt *el=&CH_ELTS(c)[e];
+		for(s=el->sibs;s<el->sibs+el->nsibs;s++)
+		{
+			sel_elt2 *sb=&CH_SIBS(c)[s];
+			for(f=sb->selfs;f<sb->selfs+sb->nselfs;f++)
+			{
+				FP_BYTE(2+CH_SELFS(c)[f].type);
+				const char *n=CH_SELFS(c)[f].name?atoms[CH_SELFS(c)[f].name]:NULL; // if it's all UNIVs, nothing has been interned yet
+				if(n)
+					for(;*n;n++)
+						FP_BYTE(*n);
+				FP_BYTE(0);
+			}
+			FP_BYTE(KEY_END_SELFS);
+		}
+		FP_BYTE(KEY_END_SIBS);
+		FP_BYTE((e+1<c->nelts)?1+el->nextrel:0);
+	}
+	#undef FP_BYTE
+	return(h?h:1); // 0 is for a NULL chain
+}
+
+int dup_groups(selector * sels, int nsels)
+{
+	unsigned int size=16, mask, i;
+	while(size<2*(unsigned int)nsels)
+		size*=2;
+	mask=size-1;
+	int *table=(int *)malloc(size*sizeof(int)); // index into sels[] of each group's first member, or -1
+	if(!table)
+		return(1);
+	memset(table, 0xff, size*sizeof(int));
+	for(i=0;i<(unsigned int)nsels;i++)
+	{
+		unsigned long long fp=sels[i].chain?sels[i].chain->fp:0;
+		unsigned int b=(fp^(fp>>32))&mask;
+		while(table[b]>=0)
+		{
+			if(treecmp(sels[table[b]].chain, sels[i].chain)==0) // differing fps fail fast, so this only walks the chains of real dups (and collisions)
+				break;
+			b=(b+1)&mask;
+		}
+		if(table[b]<0)
+			table[b]=i;
+		sels[i].group=table[b];
+	}
+	free(table);
+	return(0);
+}
+
+int selfcmp(const sel_elt3 * left, const sel_elt3 * right)
+{
+	if(left->type!=right->type)
+		return(left->type-right->type);
+	if(left->name==right->name)
+		return(0);
+	const char *l=atoms[left->name], *r=atoms[right->name]; // by string, not atom, so the order doesn't depend on what was interned first
+	if(!(l && r))
+		return(l?1:-1);
+	return(strcmp(l, r));
+}
+
+int treecmp3(sel_elt3 * left, int nleft, sel_elt3 * right, int nright)
+{
+	int i;
+	for(i=0;(i<nleft)&&(i<nright);i++)
+	{
+		int dtype=left[i].type - right[i].type;
+		if(dtype)
+			return(dtype);
+		if(left[i].name!=right[i].name) // UNIV has no name
+		{
+			unsigned int l=atomrank[left[i].name], r=atomrank[right[i].name];
+			return((l>r)-(l<r));
+		}
+	}
+	return((nleft>nright)-(nleft<nright));
+}
+
+int treecmp2(sel_chain * lc, sel_elt * left, sel_chain * rc, sel_elt * right)
+{
+	unsigned int i;
+	for(i=0;(i<left->nsibs)&&(i<right->nsibs);i++)
+	{
+		sel_elt2 *ls=&CH_SIBS(lc)[left->sibs+i], *rs=&CH_SIBS(rc)[right->sibs+i];
+		int dselfs=treecmp3(CH_SELFS(lc)+ls->selfs, ls->nselfs, CH_SELFS(rc)+rs->selfs, rs->nselfs);
+		if(dselfs)
+			return(dselfs);
+	}
+	return((left->nsibs>right->nsibs)-(left->nsibs<right->nsibs));
+}
+
+int treecmp(sel_chain * left, sel_chain * right)
+{
+	unsigned long long lfp=left?left->fp:0, rfp=right?right->fp:0;
+	if(lfp!=rfp)
+		return((lfp>rfp)-(lfp<rfp));
+	if(left && right && (left->size==right->size) && !memcmp(left, right, left->size)) // compounds are canonical and the block has no padding, so equal chains are equal bytes
+		return(0);
+	unsigned int nleft=left?left->nelts:0, nright=right?right->nelts:0;
+	unsigned int i;
+	for(i=0;(i<nleft)&&(i<nright);i++)
+	{
+		sel_elt *l=&CH_ELTS(left)[i], *r=&CH_ELTS(right)[i];
+		int dsibs=treecmp2(left, l, right, r);
+		if(dsibs)
+			return(dsibs);
+		int lrel=(i+1<nleft)?1+l->nextrel:0, rrel=(i+1<nright)?1+r->nextrel:0;
+		if(lrel!=rrel)
+			return(lrel-rrel);
+	}
+	return((nleft>nright)-(nleft<nright));
+}
+
+bitword * test(int parmc, char *parmv[], css_set * s)
+{
+	qplan q;
+	if(plan_query(&q, parmc, parmv, s))
+		return(NULL);
+	int nw=BITWORDS(s->nsels), w, t, rows=0;
+	bitword *showit=(bitword *)calloc(nw+1, sizeof(bitword)), *cand=q.none?NULL:index_cands(&q, s);
+	if(!showit)
+	{
+		free(cand);
+		free_plan(&q);
+		return(NULL);
+	}
+	for(w=q.lo/64;(w<BITWORDS(q.hi))&&(rows<q.nrows)&&!q.none;w++) // a word at a time, with all the terms at once, so we can stop as soon as there are enough rows
+	{
+		if(cand && !cand[w])
+			continue;
+		bitword m=cand?cand[w]:~0ull;
+		if(w==q.lo/64)
+			m&=~0ull<<(q.lo%64);
+		if((w==q.hi/64) && (q.hi%64))
+			m&=~(~0ull<<(q.hi%64));
+		for(t=0;m && (t<q.nterms);t++) // 'last' is a bitset already, so it takes whole words
+		{
+			if(q.terms[t].field==QF_LAST)
+				m&=(term_cmp(&q.terms[t], 1)?s->lmatch[w]:0)|(term_cmp(&q.terms[t], 0)?~s->lmatch[w]:0);
+		}
+		bitword r;
+		for(r=m;r;r&=r-1) // the rest, for each selector that's still in
+		{
+			int i=w*64+__builtin_ctzll(r);
+			for(t=0;t<q.nterms;t++)
+			{
+				if((q.terms[t].field!=QF_LAST) && !run_term(&q.terms[t], s, i))
+				{
+					m&=~(1ull<<(i%64));
+					break;
+				}
+			}
+		}
+		int n=__builtin_popcountll(m);
+		while(rows+n>q.nrows) // too many; drop the last ones
+		{
+			m&=~(1ull<<(63-__builtin_clzll(m)));
+			n--;
+		}
+		showit[w]=m;
+		rows+=n;
+	}
+	memcpy(s->lmatch, showit, nw*sizeof(bitword));
+	free(cand);
+	free_plan(&q);
+	return(showit);
 }
 
-void tree_free3(sel_elt3 * node)
+bitword * index_cands(qplan * q, css_set * s)
 {
-	if(node)
+	bool byfile=q->files && s->byline, bydup=(q->duplo>0) && s->dupsels;
+	int nw=BITWORDS(s->nsels)+1, f, a, b, k, h, t;
+	bitword *c=NULL, *r=NULL;
+	if(!(byfile || bydup))
+		goto rules;
+	if(!(c=(bitword *)calloc(nw, sizeof(bitword)))) // then test() can do without
+		return(NULL);
+	#define BISECT(lo, hi, cond)	while((lo)<(hi)) { int p=((lo)+(hi))/2; if(cond) (hi)=p; else (lo)=p+1; } // lo becomes the first p in [lo,hi) for which cond holds (and it holds for all those after)
+	#define LINE_AT(p)	(s->entries[s->sort[s->byline[p]].ent].line)
+	if(byfile) // the files' runs of byline[], cut down to the lines we want
+	{
+		for(f=0;f<s->nfiles;f++)
+		{
+			if(!q->files[f])
+				continue;
+			a=s->fileoff[f];
+			h=s->fileoff[f+1];
+			BISECT(a, h, LINE_AT(p)>=q->linelo);
+			b=a;
+			h=s->fileoff[f+1];
+			BISECT(b, h, LINE_AT(p)>q->linehi);
+			for(k=a;k<b;k++)
+				c[s->byline[k]/64]|=1ull<<(s->byline[k]%64);
+		}
+	}
+	else // the run of dupsels[] in [duplo,duphi]
+	{
+		a=0;
+		h=s->ndupsels;
+		BISECT(a, h, s->sort[s->dupsels[p]].dup>=q->duplo);
+		b=a;
+		h=s->ndupsels;
+		BISECT(b, h, s->sort[s->dupsels[p]].dup>q->duphi);
+		for(k=a;k<b;k++)
+			c[s->dupsels[k]/64]|=1ull<<(s->dupsels[k]%64);
+	}
+	#undef BISECT
+	#undef LINE_AT
+	rules:
+	for(t=0;s->byrule && (t<q->nterms);t++) // each match= tree ANDs in the buckets it could match
 	{
-		if(node->data)
-			free(node->data);
-		tree_free3(node->next);
-		free(node);
+		if((q->terms[t].field!=QF_MATCH) || q->terms[t].neg)
+			continue;
+		if(!r && !(r=(bitword *)calloc(nw, sizeof(bitword))))
+			break;
+		if(!rule_cands(q->terms[t].tree, s, r))
+			continue;
+		if(!c)
+		{
+			c=r;
+			r=NULL;
+			continue;
+		}
+		for(k=0;k<nw;k++)
+			c[k]&=r[k];
+		memset(r, 0, nw*sizeof(bitword));
 	}
+	free(r);
+	return(c);
 }
 
-void tree_free2(sel_elt2 * node)
+unsigned int rule_key(sel_chain * c, unsigned int n)
 {
-	if(node)
+	if(!c || !c->nelts || !CH_ELTS(c)[c->nelts-1].nsibs) // * (the rest of the chain doesn't matter, as tree_match() starts from the right)
+		return(RULE_UNIV);
+	sel_elt *e=&CH_ELTS(c)[c->nelts-1];
+	sel_elt2 *sb=&CH_SIBS(c)[e->sibs+e->nsibs-1];
+	sel_elt3 *sf=CH_SELFS(c)+sb->selfs;
+	unsigned int key=RULE_UNIV, f;
+	for(f=0;f<sb->nselfs;f++)
 	{
-		tree_free2(node->next);
-		tree_free3(node->selfs);
-		free(node);
+		switch(sf[f].type)
+		{
+			case ID:
+				return(RULE_ID(sf[f].name));
+			case CLASS:
+				if((key==RULE_UNIV) || (key>=RULE_TAG(0, n)))
+					key=RULE_CLASS(sf[f].name, n);
+			break;
+			case TAG:
+				if(key==RULE_UNIV)
+					key=RULE_TAG(sf[f].name, n);
+			break;
+			default:
+			break;
+		}
 	}
+	return(key);
 }
 
-void tree_free(sel_elt * node)
+bitword anc_bit(sel_elt3 * f)
 {
-	if(node)
+	unsigned int h=(f->name*8+f->type)*2654435761u; // (Knuth's multiplicative hash; the top bits are the good ones)
+	switch(f->type)
 	{
-		tree_free(node->next);
-		tree_free2(node->sibs);
-		free(node);
+		case ID:
+			return(1ull<<(h>>28));
+		case TAG:
+			return(1ull<<(16+(h>>28)));
+		case CLASS:
+		case PCLASS:
+		case ATTR:
+			return(1ull<<(32+(h>>27)));
+		default:
+			return(0);
 	}
 }
 
-int treecmp3(sel_elt3 * left, sel_elt3 * right)
+bitword anc_mask(sel_chain * c)
 {
-	if(left && right)
+	if(!c || !c->nelts || !CH_ELTS(c)[c->nelts-1].nsibs) // * matches everything
+		return(0);
+	bitword m=0;
+	int e;
+	unsigned int f;
+	for(e=(int)c->nelts-2;e>=0;e--)
 	{
-		int dtype=left->type - right->type;
-		if(dtype)
-			return(dtype);
-		int ddata=strcmp(left->data, right->data);
-		if(ddata)
-			return(ddata);
-		return(treecmp3(left->next, right->next));
+		sel_elt *el=&CH_ELTS(c)[e];
+		if(!el->nsibs) // tree_match_real() stops at a *
+			break;
+		sel_elt2 *sb=&CH_SIBS(c)[el->sibs+el->nsibs-1];
+		for(f=0;f<sb->nselfs;f++)
+			m|=anc_bit(&CH_SELFS(c)[sb->selfs+f]);
 	}
-	if(left)
-		return(1);
-	if(right)
-		return(-1);
-	return(0);
+	return(m);
 }
 
-int treecmp2(sel_elt2 * left, sel_elt2 * right)
+bitword anc_care(sel_chain * m)
 {
-	if(left && right)
+	bitword have=0, care=~0ull;
+	int e;
+	unsigned int f;
+	for(e=0;m && (e<(int)m->nelts-1);e++) // (with no ancestors, a selector can't have any)
 	{
-		if(left->next && right->next)
+		sel_elt *el=&CH_ELTS(m)[e];
+		if(!el->nsibs) // an empty element matches anything
+			return(0);
+		sel_elt2 *sb=&CH_SIBS(m)[el->sibs+el->nsibs-1];
+		sel_elt3 *mf=CH_SELFS(m)+sb->selfs;
+		bool hastag=false;
+		for(f=0;f<sb->nselfs;f++)
 		{
-			int drel=left->nextrel - right->nextrel;
-			if(drel)
-				return(drel);
+			if(mf[f].type==UNIV)
+				return(0);
+			if(mf[f].type==TAG)
+				hastag=true;
+			if(mf[f].name!=ATOM_ANY)
+				have|=anc_bit(&mf[f]);
+			else if(mf[f].type==ID)
+				care&=~ANC_ID;
+			else if(mf[f].type==TAG)
+				care&=~ANC_TAG;
+			else
+				care&=~ANC_OTHER;
 		}
-		int dselfs=treecmp3(left->selfs, right->selfs);
-		if(dselfs)
-			return(dselfs);
-		return(treecmp2(left->next, right->next));
+		if(!hastag) // then any tag goes
+			care&=~ANC_TAG;
 	}
-	if(left)
-		return(1);
-	if(right)
-		return(-1);
-	return(0);
+	return(care&~have);
 }
 
-int treecmp(sel_elt * left, sel_elt * right)
+bool rule_cands(sel_chain * m, css_set * s, bitword * c)
 {
-	if(left && right)
+	if(!m || !m->nelts || !CH_ELTS(m)[m->nelts-1].nsibs) // matches anything
+		return(false);
+	sel_elt *e=&CH_ELTS(m)[m->nelts-1];
+	sel_elt2 *sb=&CH_SIBS(m)[e->sibs+e->nsibs-1];
+	sel_elt3 *mf=CH_SELFS(m)+sb->selfs;
+	unsigned int n=s->natoms, f;
+	bool anyid=false, anyclass=false, anytag=false, hastag=false;
+	for(f=0;f<sb->nselfs;f++)
 	{
-		if(left->next && right->next)
+		if(mf[f].type==UNIV) // so does this
+			return(false);
+		if(mf[f].type==TAG)
+			hastag=true;
+		if(mf[f].name==ATOM_ANY)
 		{
-			int drel=left->nextrel - right->nextrel;
-			if(drel)
-				return(drel);
+			anyid|=(mf[f].type==ID);
+			anyclass|=(mf[f].type==CLASS);
+			anytag|=(mf[f].type==TAG);
 		}
-		int dsibs=treecmp2(left->sibs, right->sibs);
-		if(dsibs)
-			return(dsibs);
-		return(treecmp(left->next, right->next));
 	}
-	if(left)
-		return(1);
-	if(right)
-		return(-1);
-	return(0);
+	#define RULE_RUN(lo, hi)	{ int k_; for(k_=s->ruleoff[lo];k_<s->ruleoff[hi];k_++) c[s->byrule[k_]/64]|=1ull<<(s->byrule[k_]%64); }
+	RULE_RUN(RULE_UNIV, RULE_UNIV+1);
+	if(anyid)
+		RULE_RUN(RULE_ID(0), RULE_ID(n));
+	if(anyclass)
+		RULE_RUN(RULE_CLASS(0, n), RULE_CLASS(n, n));
+	if(anytag || !hastag) // with no tag, tree_match_3() lets any tag through
+		RULE_RUN(RULE_TAG(0, n), RULE_TAG(n, n));
+	for(f=0;f<sb->nselfs;f++) // the buckets of the names it has (a name no stylesheet uses is ATOM_NONE, whose buckets are empty)
+	{
+		if((mf[f].type==ID) && !anyid)
+			RULE_RUN(RULE_ID(mf[f].name), RULE_ID(mf[f].name)+1);
+		if((mf[f].type==CLASS) && !anyclass)
+			RULE_RUN(RULE_CLASS(mf[f].name, n), RULE_CLASS(mf[f].name, n)+1);
+		if((mf[f].type==TAG) && !anytag)
+			RULE_RUN(RULE_TAG(mf[f].name, n), RULE_TAG(mf[f].name, n)+1);
+	}
+	#undef RULE_RUN
+	return(true);
 }
 
-bool * test(int parmc, char *parmv[], selector * sort, entry * entries, char ** filename, int nsels)
+int bits_next(bitword * b, int i, int n)
 {
-	bool *showit=(bool *)malloc(sizeof(bool[nsels])); memset(showit, 0xFF, sizeof(bool[nsels]));
-	bool show=true;
-	int nrows=nsels;
-	int parm;
-	for(parm=0;(parm<parmc)&&show;parm++)
+	if(i>=n)
+		return(n);
+	int w=i/64;
+	bitword m=b[w]&(~0ull<<(i%64));
+	while(!m)
 	{
+		if(++w>=BITWORDS(n))
+			return(n);
+		m=b[w];
+	}
+	return(min(w*64+__builtin_ctzll(m), n));
+}
+
+int plan_query(qplan * q, int parmc, char *parmv[], css_set * s)
+{
+	*q=(qplan){.terms=(qterm *)malloc((parmc+1)*sizeof(qterm)), .hi=s->nsels, .nrows=s->nsels, .linehi=INT_MAX, .duphi=INT_MAX}; // (lines and dups are never negative)
+	int parm, k;
+	int ncheap=0; // the terms are built from both ends, so the match= trees come last without a sort
+	for(parm=0;(parm<parmc)&&q->terms;parm++)
+	{
+		char *tparm=parmv[parm];
 		bool neg=false;
-		char *sparm=strdup(parmv[parm]);
-		char *tparm=sparm;
 		if(*tparm=='!')
 		{
 			neg=true;
 			tparm++;
 		}
-		char *cmp=tparm;
-		while(*cmp && !strchr("=<>:", *cmp))
-			cmp++;
-		char wcmp=*cmp;
-		*cmp=0;
-		cmp++;
-		bool eq=false;
-		bool num=false;
-		bool tree=false;
-		char *smatch=NULL;
-		int nmatch;
-		int inval=0;
-		sscanf(cmp, "%d", &inval);
-		int matcher=0;
-		if(strcmp(tparm, "sid")==0)
-		{
-			num=true;matcher=1;
-		}
-		else if(strcmp(tparm, "file")==0)
-		{
-			matcher=2;
-		}
-		else if(strcmp(tparm, "line")==0)
-		{
-			num=true;matcher=3;
-		}
-		else if(strcmp(tparm, "match")==0)
-		{
-			tree=true;matcher=4;
-		}
-		else if(strcmp(tparm, "dup")==0)
-		{
-			num=true;matcher=5;
-		}
-		else if(strcmp(tparm, "last")==0)
-		{
-			num=true;matcher=6;
-		}
-		else if(strcmp(tparm, "rows")==0) // Have to apply this /after/ all others
+		size_t nlen=strcspn(tparm, "=<>:");
+		char name[nlen+1], wcmp=tparm[nlen], *cmp=tparm+nlen+(wcmp?1:0);
+		memcpy(name, tparm, nlen);
+		name[nlen]=0;
+		qterm t={.neg=neg, .prep=-1};
+		if(strcmp(name, "sid")==0)
+			t.field=QF_SID;
+		else if(strcmp(name, "file")==0)
+			t.field=QF_FILE;
+		else if(strcmp(name, "line")==0)
+			t.field=QF_LINE;
+		else if(strcmp(name, "match")==0)
+			t.field=QF_MATCH;
+		else if(strcmp(name, "dup")==0)
+			t.field=QF_DUP;
+		else if(strcmp(name, "last")==0)
+			t.field=QF_LAST;
+		else if(strcmp(name, "rows")==0) // applies /after/ all the others
 		{
-			nrows=min(nrows, inval);
-			free(sparm);
+			int inval=0;
+			sscanf(cmp, "%d", &inval);
+			q->nrows=min(q->nrows, inval);
 			continue;
 		}
 		else
@@ -1340,232 +4605,295 @@ bool * test(int parmc, char *parmv[], selector * sort, entry * entries, char **
 				printf("ERR:EBADPARM:BADPARAM:%d:\"%s\"\n", parm, parmv[parm]);
 			else
 				fprintf(output, "cssi: Error: Bad matcher %s (unrecognised param)\n", parmv[parm]);
-			free(sparm);free(showit);return(NULL);
-		}
-		selector tmatch;
-		int prep=-1;
-		if(tree)
-		{
-			// parse the tree outside the loop, rather than once for each sel in the list
-			if(isdigit(*cmp))
-			{
-				prep=inval;
-				while(isdigit(*cmp)) cmp++;
-			}
-			tmatch.text=cmp;
-			int e=parse_selector(&tmatch, -1);
-			if(e)
-			{
-				free(sparm);free(showit);return(NULL);
-			}
+			goto bad;
 		}
-		int i;
-		for(i=0;(i<nsels)&&(showit[i]);i++)
+		bool num=(t.field!=QF_FILE)&&(t.field!=QF_MATCH);
+		switch(wcmp)
 		{
-			show=true;
-			bool lmatch=sort[i].lmatch;
-			sort[i].lmatch=false;
-			int ent=sort[i].ent;
-			int file=entries[ent].file;
-			switch(matcher)
-			{
-				case 1:
-					nmatch=i;
-				break;
-				case 2:
-					smatch=filename[file];
-				break;
-				case 3:
-					nmatch=entries[ent].line+(daemonmode?0:1); // daemon mode uses 0-based linenos
-				break;
-				case 4:
-					smatch=(char *)sort[i].chain; // it's a sel_elt *, really, not a char *
-				break;
-				case 5:
-					nmatch=sort[i].dup;
-				break;
-				case 6:
-					nmatch=lmatch;
-				break;
-				default:
+			case 0:
+				t.op=QOP_NZ;
+			break;
+			case '=':
+				t.op=QOP_EQ;
+			break;
+			case '<':
+			case '>':
+				if(!num)
+				{
 					if(daemonmode)
-						printf("ERR:EBADPARM:BADPARAM:%d:\"%s\"\n", parm, parmv[parm]);
-					else
-						fprintf(output, "cssi: Error: Bad matcher %s (unrecognised param)\n", parmv[parm]);
-					free(sparm);free(showit);return(NULL);
-				break;
-			}
-			switch(wcmp)
-			{
-				case '=':
-					if(tree)
-					{
-						sel_elt * curr=(sel_elt *)smatch;
-						sel_elt * match=tmatch.chain;
-						show=tree_match(curr, match, prep);
-					}
-					else if(num)
-					{
-						show=(nmatch == inval);
-					}
-					else
-					{
-						show=(strcmp(smatch, cmp)==0);
-					}
-				break;
-				case '<':
-					if(*cmp=='=')
-					{
-						eq=true;cmp++;sscanf(cmp, "%d", &inval);
-					}
-					if(num)
-					{
-						show=eq?(nmatch <= inval):(nmatch < inval);
-					}
-					else
-					{
-						if(daemonmode)
-							printf("ERR:EBADPARM:NUMCOMP:%d:\"%s\"\n", parm, parmv[parm]);
-						else
-							fprintf(output, "cssi: Error: '<' is for numerics only (%s)\n", parmv[parm]);
-						free(sparm);free(showit);return(NULL);
-					}
-				break;
-				case '>':
-					if(*cmp=='=')
-					{
-						eq=true;cmp++;sscanf(cmp, "%d", &inval);
-					}
-					if(num)
-					{
-						show=eq?(nmatch >= inval):(nmatch > inval);
-					}
-					else
-					{
-						if(daemonmode)
-							printf("ERR:EBADPARM:NUMCOMP:%d:\"%s\"\n", parm, parmv[parm]);
-						else
-							fprintf(output, "cssi: Error: '>' is for numerics only (%s)\n", parmv[parm]);
-						free(sparm);free(showit);return(NULL);
-					}
-				break;
-				case ':':
-					if(num||tree)
-					{
-						if(daemonmode)
-							printf("ERR:EBADPARM:STRCOMP:%d:\"%s\"\n", parm, parmv[parm]);
-						else
-							fprintf(output, "cssi: Error: ':' is for strings only (%s)\n", parmv[parm]);
-						free(sparm);free(showit);return(NULL);
-					}
+						printf("ERR:EBADPARM:NUMCOMP:%d:\"%s\"\n", parm, parmv[parm]);
 					else
-					{
-						if(daemonmode)
-							printf("ERR:ENOSYS:REGEXMATCH:%d:\"%s\"\n", parm, parmv[parm]);
-						else
-							fprintf(output, "cssi: Error: regex-matching unimplemented (%s)\n", parmv[parm]);
-						free(sparm);free(showit);return(NULL);
-					}
-				break;
-				case 0:
-					if(num)
-						show=(nmatch!=0);
-					else if(tree)
-					{
-						// ignore "match" without a comparator; matches everything
-					}
+						fprintf(output, "cssi: Error: '%c' is for numerics only (%s)\n", wcmp, parmv[parm]);
+					goto bad;
+				}
+				t.op=(wcmp=='<')?QOP_LT:QOP_GT;
+				if(*cmp=='=')
+				{
+					t.op++; // QOP_LE, QOP_GE
+					cmp++;
+				}
+			break;
+			default: // ':'
+				if(daemonmode)
+				{
+					if(num || (t.field==QF_MATCH))
+						printf("ERR:EBADPARM:STRCOMP:%d:\"%s\"\n", parm, parmv[parm]);
 					else
-						show=smatch?smatch[0]:0;
-				break;
-				default: // this should be impossible
-					if(daemonmode)
-						printf("ERR:EBADPARM:BADCOMP:%d:\"%s\"\n", parm, parmv[parm]);
+						printf("ERR:ENOSYS:REGEXMATCH:%d:\"%s\"\n", parm, parmv[parm]);
+				}
+				else if(num || (t.field==QF_MATCH))
+					fprintf(output, "cssi: Error: ':' is for strings only (%s)\n", parmv[parm]);
+				else
+					fprintf(output, "cssi: Error: regex-matching unimplemented (%s)\n", parmv[parm]);
+				goto bad;
+			break;
+		}
+		sscanf(cmp, "%d", &t.val);
+		bool always=false; // (before neg)
+		switch(t.field)
+		{
+			case QF_SID: // not a test at all, just where to start and stop
+				if(!neg)
+				{
+					long long lo=0, hi=s->nsels-1;
+					term_bounds(&t, &lo, &hi);
+					q->lo=max(q->lo, (int)max(min(lo, s->nsels), 0));
+					q->hi=min(q->hi, (int)max(min(hi+1, s->nsels), 0));
+					continue;
+				}
+			break;
+			case QF_LINE: // the user's line numbers are 1-based, unless we're a daemon
+				if(!daemonmode)
+				{
+					if(t.op==QOP_NZ)
+						always=true;
 					else
-						fprintf(output, "cssi: Error: Bad matcher %s (bad comparator)\n", parmv[parm]);
-					free(sparm);free(showit);return(NULL);
-				break;
-			}
-			show^=neg; // XOR it with neg - if neg is true then we want to invert its sense
-			showit[i]&=show;
+						t.val--;
+				}
+			break;
+			case QF_FILE:
+				if(!(t.files=(bool *)malloc((s->nfiles+1)*sizeof(bool))))
+					goto nomem;
+				always=true;
+				for(k=0;k<s->nfiles;k++)
+				{
+					t.files[k]=((t.op==QOP_EQ)?!strcmp(s->filename[k], cmp):!!s->filename[k][0])^neg;
+					always&=(t.files[k]^neg);
+				}
+				if(!always)
+				{
+					for(k=0;(k<s->nfiles)&&!t.files[k];k++);
+					q->none|=(k==s->nfiles); // no file will do
+				}
+			break;
+			case QF_MATCH:
+				if(t.op==QOP_NZ) // "match" without a comparator matches everything
+				{
+					always=true;
+					break;
+				}
+				if(isdigit(*cmp)) // the prepension limit
+				{
+					t.prep=t.val;
+					while(isdigit(*cmp))
+						cmp++;
+				}
+				selector tmatch;
+				if(parse_selector(&tmatch, cmp, -1, &q->scratch, NULL))
+					goto bad;
+				t.tree=tmatch.chain;
+				if(!t.prep)
+					t.anc=anc_care(t.tree);
+			break;
+			default:
+			break;
+		}
+		if(always) // constant, so there's nothing to test for each selector
+		{
+			free(t.files);
+			q->none|=neg;
+			continue;
 		}
-		if(tree)
-			tree_free(tmatch.chain);
-		free(sparm);
+		if(!neg) // what an index could narrow the search down to
+		{
+			if(t.field==QF_LINE)
+				term_bounds(&t, &q->linelo, &q->linehi);
+			else if(t.field==QF_DUP)
+				term_bounds(&t, &q->duplo, &q->duphi);
+			else if((t.field==QF_FILE) && !q->files)
+				q->files=t.files;
+		}
+		if(t.field==QF_MATCH)
+			q->terms[parmc-1-(q->nterms-ncheap)]=t;
+		else
+			q->terms[ncheap++]=t;
+		q->nterms++;
 	}
-	int i;
-	int rows=0;
-	for(i=0;i<nsels;i++)
+	if(!q->terms)
+		goto nomem;
+	memmove(q->terms+ncheap, q->terms+parmc-(q->nterms-ncheap), (q->nterms-ncheap)*sizeof(qterm)); // the trees, to follow the rest (in reverse; it doesn't matter)
+	q->none|=(q->nrows<=0);
+	return(0);
+	nomem:
+	fprintf(output, "cssi: Error: Failed to alloc mem for query.\n");
+	if(daemonmode)
+		printf("ERR:EMEM\n");
+	bad:
+	if(q->terms) // (the match= terms aren't in the count yet, but have no files[] to free)
 	{
-		showit[i]&=(rows<nrows);
-		sort[i].lmatch=showit[i];
-		if(showit[i])
-			rows++;
+		for(k=0;k<ncheap;k++)
+			free(q->terms[k].files);
 	}
-	return(showit);
+	free(q->terms);
+	arena_free(&q->scratch);
+	return(1);
+}
+
+bool run_term(qterm * t, css_set * s, int i)
+{
+	selector *sel=&s->sort[i];
+	int n;
+	switch(t->field)
+	{
+		case QF_FILE:
+			n=s->entries[sel->ent].file;
+			return((n<s->nfiles)?t->files[n]:t->neg);
+		case QF_MATCH:
+			if(t->anc & s->ancmask[i]) // it has an ancestor the tree hasn't
+				return(t->neg);
+			return(tree_match(sel->chain, t->tree, t->prep, &t->memo)^t->neg);
+		case QF_SID:
+			n=i;
+		break;
+		case QF_LINE:
+			n=s->entries[sel->ent].line;
+		break;
+		default: // QF_DUP
+			n=sel->dup;
+		break;
+	}
+	return(term_cmp(t, n));
+}
+
+void term_bounds(qterm * t, long long * lo, long long * hi)
+{
+	long long v=t->val;
+	switch(t->op)
+	{
+		case QOP_NZ: *lo=max(*lo, 1); break; // (for a value that can't be negative)
+		case QOP_EQ: *lo=max(*lo, v); *hi=min(*hi, v); break;
+		case QOP_LT: *hi=min(*hi, v-1); break;
+		case QOP_LE: *hi=min(*hi, v); break;
+		case QOP_GT: *lo=max(*lo, v+1); break;
+		default: *lo=max(*lo, v); break; // QOP_GE
+	}
+}
+
+bool term_cmp(qterm * t, int n)
+{
+	bool show;
+	switch(t->op)
+	{
+		case QOP_NZ: show=(n!=0); break;
+		case QOP_EQ: show=(n==t->val); break;
+		case QOP_LT: show=(n<t->val); break;
+		case QOP_LE: show=(n<=t->val); break;
+		case QOP_GT: show=(n>t->val); break;
+		default: show=(n>=t->val); break;
+	}
+	return(show^t->neg);
+}
+
+void free_plan(qplan * q)
+{
+	int t;
+	for(t=0;t<q->nterms;t++)
+	{
+		free(q->terms[t].files);
+		free(q->terms[t].memo.val);
+	}
+	free(q->terms);
+	arena_free(&q->scratch);
 }
 
-bool tree_match(sel_elt * curr, sel_elt * match, int prep)
+bool tree_match(sel_chain * curr, sel_chain * match, int prep, tm_memo * memo)
 {
 	//fprintf(stderr, "tree_match(%p,%p)\n", curr, match);
-	if(curr)
+	if(!curr || !curr->nelts) // * matches everything
+		return(true);
+	if((prep<0) || (curr->nelts<3)) // unlimited prepension takes DESC's shortcut, and with fewer than three elements no subproblem comes up twice
+		memo=NULL;
+	if(memo)
 	{
-		sel_elt * clast=curr;
-		while(clast->next) clast=clast->next;
-		sel_elt * mlast=match;
-		while(mlast && mlast->next) mlast=mlast->next;
-		return tree_match_real(clast, mlast, prep); // a match of NULL means prepension is completely acceptable - "match=" matches everything
+		memo->nm=(match?match->nelts:0)+1;
+		memo->np=curr->nelts;
+		size_t size=(size_t)curr->nelts*memo->nm*memo->np;
+		if(size>memo->size)
+		{
+			unsigned char *v=(unsigned char *)realloc(memo->val, size);
+			if(v)
+			{
+				memo->val=v;
+				memo->size=size;
+			}
+		}
+		if(size>memo->size) // then do without
+			memo=NULL;
+		else
+			memset(memo->val, 0, size);
 	}
-	else return(true); // * matches everything
+	return tree_match_real(curr, curr->nelts-1, match, (match && match->nelts)?(int)match->nelts-1:-1, prep, memo); // a match of -1 means prepension is completely acceptable - "match=" matches everything
 }
 
-bool tree_match_real(sel_elt *curr, sel_elt *match, int prep)
+bool tree_match_real(sel_chain * c, int curr, sel_chain * m, int match, int prep, tm_memo * memo)
 {
-	//fprintf(stderr, "tree_match_real(%p,%p)\n", curr, match);
-	if(!curr) // * matches everything
+	if(curr<0) // * matches everything
 		return(true);
-	sel_elt2 * sblg=curr->last, *mblg=match?match->last:NULL;
-	//fprintf(stderr, "sblg=%p, mblg=%p\n", sblg, mblg);
-	if(!sblg) // * matches everything
+	if(!memo)
+		return(tree_match_elt(c, curr, m, match, prep, NULL));
+	// a limit of curr or more can't run out before the chain does, so those all have the same answer
+	unsigned char *v=&memo->val[((size_t)curr*memo->nm+match+1)*memo->np+min(prep, curr)];
+	if(!*v)
+		*v=1+tree_match_elt(c, curr, m, match, prep, memo);
+	return(*v-1);
+}
+
+bool tree_match_elt(sel_chain * c, int curr, sel_chain * m, int match, int prep, tm_memo * memo)
+{
+	//fprintf(stderr, "tree_match_elt(%d,%d)\n", curr, match);
+	sel_elt *ce=&CH_ELTS(c)[curr], *me=(match>=0)?&CH_ELTS(m)[match]:NULL;
+	if(!ce->nsibs) // * matches everything
 		return(true);
-	sel_elt3 * selfs, *melfs;
+	int sblg=ce->sibs+ce->nsibs-1, mblg=(me && me->nsibs)?(int)(me->sibs+me->nsibs-1):-1; // start from the last siblings
+	//fprintf(stderr, "sblg=%d, mblg=%d\n", sblg, mblg);
+	sel_elt2 *ss, *ms;
+	bool selfmatch;
 	repeat2:
-	selfs=sblg->selfs;
-	melfs=mblg?mblg->selfs:NULL;
-	//fprintf(stderr, "selfs=%p, melfs=%p\n", selfs, melfs);
-	bool selfmatch=tree_match_3(selfs, melfs);
-	if(selfmatch && sblg->prev && mblg)
+	ss=&CH_SIBS(c)[sblg];
+	ms=(mblg>=0)?&CH_SIBS(m)[mblg]:NULL;
+	selfmatch=tree_match_3(CH_SELFS(c)+ss->selfs, ss->nselfs, ms?CH_SELFS(m)+ms->selfs:NULL, ms?ms->nselfs:0);
+	if(selfmatch && (sblg>(int)ce->sibs) && ms) // the relation between siblings is always SBLG
 	{
-		switch(sblg->prev->nextrel)
+		// TODO some kind of checking to deal with inappropriate explicit :first-child - maybe in parse_selector()
+		if(has_firstchild(CH_SELFS(m)+ms->selfs, ms->nselfs)) // x+y can never match :first-child
+			return(false);
+		else if(mblg>(int)me->sibs) // if not, we just ignore the rest of the elder siblings, because prepending sibs doesn't cost a prepend
 		{
-			case SBLG: // TODO some kind of checking to deal with inappropriate explicit :first-child - maybe in parse_selector()
-				if(has_firstchild(melfs)) // x+y can never match :first-child
-					return(false);
-				else if(mblg->prev) // if not, we just ignore the rest of the elder siblings, because prepending sibs doesn't cost a prepend
-				{
-					sblg=sblg->prev;
-					mblg=mblg->prev;
-					//fprintf(stderr, "repeat2: sblg=%p, mblg=%p\n", sblg, mblg);
-					goto repeat2;
-				}
-			break;
-			default:
-				if(daemonmode)
-					printf("ERR:EINTERN:NEXTREL:%d\n", curr->nextrel);
-				else
-					fprintf(output, "cssi: Error: Internal error (Bad nextrel %d)\n", curr->nextrel);
-				return(false);
-			break;
+			sblg--;
+			mblg--;
+			//fprintf(stderr, "repeat2: sblg=%d, mblg=%d\n", sblg, mblg);
+			goto repeat2;
 		}
 	}
 	//fprintf(stderr, "%d, childing\n", selfmatch);
-	if(selfmatch && curr->prev)
+	if(selfmatch && (curr>0))
 	{
-		switch(curr->prev->nextrel)
+		switch(CH_ELTS(c)[curr-1].nextrel)
 		{
 			case CHLD:
-				if(match && match->prev)
+				if(match>0)
 				{
-					return(tree_match_real(curr->prev, match->prev, prep));
+					return(tree_match_real(c, curr-1, m, match-1, prep, memo));
 				}
 				else if(prep==-1)
 				{
@@ -1577,7 +4905,7 @@ bool tree_match_real(sel_elt *curr, sel_elt *match, int prep)
 				}
 				else
 				{
-					return(tree_match_real(curr->prev, match?match->prev:NULL, prep-1));
+					return(tree_match_real(c, curr-1, m, -1, prep-1, memo));
 				}
 			break;
 			case DESC: // with unlimited prepension, this would always end up TRUE anyway, because it can be a descendant of whatever you want it to be
@@ -1587,23 +4915,23 @@ bool tree_match_real(sel_elt *curr, sel_elt *match, int prep)
 				}
 				else
 				{
-					while(match && match->prev)
+					int mj;
+					for(mj=match-1;mj>=0;mj--)
 					{
-						bool matched=tree_match_real(curr->prev, match->prev, prep);
+						bool matched=tree_match_real(c, curr-1, m, mj, prep, memo);
 						if(matched)
 							return(true);
-						match=match->prev;
 					}
 					if(prep==0)
 						return(false);
-					return(tree_match_real(curr->prev, NULL, prep-1));
+					return(tree_match_real(c, curr-1, m, -1, prep-1, memo));
 				}
 			break;
 			default:
 				if(daemonmode)
-					printf("ERR:EINTERN:NEXTREL:%d\n", curr->nextrel);
+					printf("ERR:EINTERN:NEXTREL:%d\n", CH_ELTS(c)[curr-1].nextrel);
 				else
-					fprintf(output, "cssi: Error: Internal error (Bad nextrel %d)\n", curr->nextrel);
+					fprintf(output, "cssi: Error: Internal error (Bad nextrel %d)\n", CH_ELTS(c)[curr-1].nextrel);
 				return(false);
 			break;
 		}
@@ -1614,41 +4942,156 @@ bool tree_match_real(sel_elt *curr, sel_elt *match, int prep)
 	}
 }
 
-bool tree_match_3(sel_elt3 *selfs, sel_elt3 *melfs)
+bool tree_match_3(sel_elt3 *selfs, int nselfs, sel_elt3 *melfs, int nmelfs)
 {
 	bool selfmatch=true;
-	while(selfmatch && selfs && melfs) // the empty element is always matched
+	int i;
+	for(i=0;selfmatch && (i<nselfs) && nmelfs;i++) // the empty element is always matched
 	{
 		bool hastag=false;
-		sel_elt3 * melfcurr=melfs;
-		bool nomatch=(selfs->type!=UNIV); // * matches everything
-		while(nomatch && melfcurr)
+		int j;
+		bool nomatch=(selfs[i].type!=UNIV); // * matches everything
+		for(j=0;nomatch && (j<nmelfs);j++)
 		{
-			if(melfcurr->type==TAG)
+			if(melfs[j].type==TAG)
 				hastag=true;
-			if(melfcurr->type==UNIV) // * matches everything
+			if(melfs[j].type==UNIV) // * matches everything
 				nomatch=false;
-			else if(selfs->type==melfcurr->type)
+			else if(selfs[i].type==melfs[j].type)
 			{
-				if((melfcurr->data[0]=='?')||(strcmp(selfs->data, melfcurr->data)==0)) // if data begins with ?, it matches everything
+				if((melfs[j].name==ATOM_ANY)||(selfs[i].name && (selfs[i].name==melfs[j].name))) // if the name begins with ?, it matches everything
 					nomatch=false;
 			}
-			melfcurr=melfcurr->next;
 		}
-		if((selfs->type==TAG) && !hastag) // if no tag is specified, optimism is forced upon you!
+		if((selfs[i].type==TAG) && !hastag) // if no tag is specified, optimism is forced upon you!
 			nomatch=false;
 		if(nomatch)
 			selfmatch=false; // currently we're pessimistic about all four - matchp, aka match0.
-		selfs=selfs->next;
 	}
 	return(selfmatch);
 }
 
-bool has_firstchild(sel_elt3 *melfs)
+bool has_firstchild(sel_elt3 *melfs, int nmelfs)
 {
 	sel_elt3 selfs;
 	selfs.type=PCLASS;
-	selfs.data="firstchild";
-	selfs.next=NULL;
-	return(tree_match_3(&selfs, melfs));
+	selfs.name=ATOM_FIRSTCHILD;
+	return(tree_match_3(&selfs, 1, melfs, nmelfs));
+}
+
+void * arena_alloc(arena * a, size_t size)
+{
+	size=(size+7)&~(size_t)7; // keep everything 8-aligned
+	if(!a->head || (a->head->used+size>a->head->size))
+	{
+		size_t bsize=max(size, 65536-sizeof(arena_blk));
+		arena_blk *b=(arena_blk *)malloc(sizeof(arena_blk)+bsize);
+		if(!b)
+			return(NULL);
+		b->next=a->head;
+		b->used=0;
+		b->size=bsize;
+		a->head=b;
+	}
+	void *rv=a->head->data+a->head->used;
+	a->head->used+=size;
+	return(rv);
+}
+
+void arena_free(arena * a)
+{
+	while(a->head)
+	{
+		arena_blk *b=a->head;
+		a->head=b->next;
+		free(b);
+	}
+}
+
+atom intern(const char * str, size_t len, bool add)
+{
+	if(!atomhsize) // seed the table with the atoms we have #defines for
+	{
+		atomhsize=64;
+		if(!(atomhash=(unsigned int *)calloc(atomhsize, sizeof(unsigned int))))
+			return(ATOM_NONE);
+		natoms=1;
+		atoms=(char **)malloc(sizeof(char *));
+		atoms[0]=NULL;
+		intern("?", 1, true);
+		intern("firstchild", 10, true);
+	}
+	unsigned int h=2166136261u; // FNV-1a
+	size_t i;
+	for(i=0;i<len;i++)
+		h=(h^(unsigned char)str[i])*16777619u;
+	unsigned int b=h&(atomhsize-1);
+	while(atomhash[b])
+	{
+		char *a=atoms[atomhash[b]];
+		if(!strncmp(a, str, len) && !a[len])
+			return(atomhash[b]);
+		b=(b+1)&(atomhsize-1);
+	}
+	if(!add)
+		return(ATOM_NONE);
+	char *a=(char *)arena_alloc(&atomarena, len+1);
+	char **na=(char **)realloc(atoms, (natoms+1)*sizeof(char *));
+	if(!(a && na))
+		return(ATOM_NONE);
+	memcpy(a, str, len);
+	a[len]=0;
+	atoms=na;
+	atoms[natoms]=a;
+	atomhash[b]=natoms;
+	if(natoms*2>=atomhsize) // keep it at most half full
+	{
+		unsigned int nsize=atomhsize*2, *nh=(unsigned int *)calloc(nsize, sizeof(unsigned int));
+		if(nh)
+		{
+			unsigned int n;
+			for(n=1;n<=natoms;n++)
+			{
+				const char *t=atoms[n];
+				h=2166136261u;
+				for(;*t;t++)
+					h=(h^(unsigned char)*t)*16777619u;
+				b=h&(nsize-1);
+				while(nh[b])
+					b=(b+1)&(nsize-1);
+				nh[b]=n;
+			}
+			free(atomhash);
+			atomhash=nh;
+			atomhsize=nsize;
+		}
+	}
+	return(natoms++);
+}
+
+int atomcmp(const void * a, const void * b)
+{
+	return(strcmp(atoms[*(const unsigned int *)a], atoms[*(const unsigned int *)b]));
+}
+
+void rank_atoms(void)
+{
+	if(!natoms)
+		intern("", 0, false); // make sure the table exists
+	unsigned int *order=(unsigned int *)malloc(natoms*sizeof(unsigned int)), i;
+	atomrank=(unsigned int *)realloc(atomrank, natoms*sizeof(unsigned int));
+	if(!(order && atomrank))
+	{
+		fprintf(output, "cssi: Error: Failed to alloc mem for identifier ranks.\n");
+		if(daemonmode)
+			printf("ERR:EMEM\n");
+		exit(1);
+	}
+	for(i=1;i<natoms;i++)
+		order[i]=i;
+	qsort(order+1, natoms-1, sizeof(unsigned int), atomcmp);
+	atomrank[ATOM_NONE]=0;
+	for(i=1;i<natoms;i++)
+		atomrank[order[i]]=i;
+	free(order);
 }
@@ -0,0 +1,64 @@
+/*
+	css-tools - make sense of your CSS
+	Copyright (C) 2010 Edward Cree
+	See cssi.c for license details
+	
+	mktags - generate taghash.h, a perfect hash of the tags in tags.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define MKTAGS
+#include "tags.h"
+
+int main(void)
+{
+	if(ntags>255) // won't fit in taghash[]
+	{
+		fprintf(stderr, "mktags: too many tags (%d)\n", ntags);
+		return(1);
+	}
+	int bits;
+	for(bits=7;bits<=16;bits++) // smallest table first
+	{
+		unsigned int size=1u<<bits;
+		unsigned char *slot=(unsigned char *)malloc(size);
+		if(!slot)
+		{
+			fprintf(stderr, "mktags: out of memory\n");
+			return(1);
+		}
+		unsigned int seed;
+		for(seed=2166136261u;seed<2166136261u+100000;seed++)
+		{
+			memset(slot, 0, size);
+			int i;
+			for(i=0;i<ntags;i++)
+			{
+				unsigned int s=tag_hash(tags[i].name, strlen(tags[i].name), seed)>>(32-bits);
+				if(slot[s])
+					break;
+				slot[s]=i+1;
+			}
+			if(i==ntags)
+			{
+				printf("/* taghash.h - generated from tags.h by mktags; don't edit */\n\n");
+				printf("#define TAGHASH_SEED\t%uu\n", seed);
+				printf("#define TAGHASH_BITS\t%d\n\n", bits);
+				printf("const unsigned char taghash[%u]= // index into tags[] + 1, or 0 for an empty slot\n{", size);
+				unsigned int s;
+				for(s=0;s<size;s++)
+					printf("%s%s%d", s?",":"", (s%32)?"":"\n\t", slot[s]);
+				printf("\n};\n");
+				free(slot);
+				return(0);
+			}
+		}
+		free(slot);
+	}
+	fprintf(stderr, "mktags: couldn't find a perfect hash for tags[]\n");
+	return(1);
+}
@@ -8,101 +8,149 @@
 
 #define TAG_LINK 52
 
-// TODO: make this into a radix tree for faster searching, use a struct with things like a Deprecated flag (and no-close, etc) that we can warn about
-//  -- although css-tools *IS NOT A VALIDATOR*
-char *tags[]=
+#define TAG_DEPRECATED	1
+#define TAG_VOID	2 // has no content and no closing tag, eg. <br>
+
+// the lookup (tag_lookup(), in taghash.h) is generated from this table by mktags; css-tools *IS NOT A VALIDATOR*, the flags are just information
+typedef struct
+{
+	char * name;
+	int flags;
+}
+tag_info;
+
+tag_info tags[]=
 {
-	"abbr",
-	"acronym",
-	"address",
-	"applet", // DEPRECATED
-	"area",
-	"a",
-	"basefont", // DEPRECATED
-	"base",
-	"bdo",
-	"big",
-	"blockquote",
-	"body",
-	"br",
-	"button",
-	"b",
-	"caption",
-	"center", // DEPRECATED
-	"cite",
-	"code",
-	"colgroup",
-	"col",
-	"dd",
-	"del",
-	"dfn",
-	"dir", // DEPRECATED
-	"div",
-	"dl",
-	"dt",
-	"em",
-	"fieldset",
-	"font", // DEPRECATED
-	"form",
-	"frameset",
-	"frame",
-	"h1",
-	"h2",
-	"h3",
-	"h4",
-	"h5",
-	"h6",
-	"head",
-	"hr",
-	"html",
-	"iframe",
-	"img",
-	"input",
-	"ins",
-	"isindex", // DEPRECATED
-	"i",
-	"kbd",
-	"label",
-	"legend",
-	"link",
-	"li",
-	"map",
-	"menu", // DEPRECATED
-	"meta",
-	"noframes",
-	"noscript",
-	"object",
-	"ol",
-	"optgroup",
-	"option",
-	"param",
-	"pre",
-	"p",
-	"q",
-	"samp",
-	"script",
-	"select",
-	"small",
-	"span",
-	"strike", // DEPRECATED
-	"strong",
-	"style",
-	"sub",
-	"sup",
-	"s", // DEPRECATED
-	"table",
-	"tbody",
-	"td",
-	"textarea",
-	"tfoot",
-	"thead",
-	"th",
-	"title",
-	"tr",
-	"tt",
-	"ul",
-	"u", // DEPRECATED
-	"var"
+	{"abbr", 0},
+	{"acronym", 0},
+	{"address", 0},
+	{"applet", TAG_DEPRECATED},
+	{"area", TAG_VOID},
+	{"a", 0},
+	{"basefont", TAG_DEPRECATED|TAG_VOID},
+	{"base", TAG_VOID},
+	{"bdo", 0},
+	{"big", 0},
+	{"blockquote", 0},
+	{"body", 0},
+	{"br", TAG_VOID},
+	{"button", 0},
+	{"b", 0},
+	{"caption", 0},
+	{"center", TAG_DEPRECATED},
+	{"cite", 0},
+	{"code", 0},
+	{"colgroup", 0},
+	{"col", TAG_VOID},
+	{"dd", 0},
+	{"del", 0},
+	{"dfn", 0},
+	{"dir", TAG_DEPRECATED},
+	{"div", 0},
+	{"dl", 0},
+	{"dt", 0},
+	{"em", 0},
+	{"fieldset", 0},
+	{"font", TAG_DEPRECATED},
+	{"form", 0},
+	{"frameset", 0},
+	{"frame", TAG_VOID},
+	{"h1", 0},
+	{"h2", 0},
+	{"h3", 0},
+	{"h4", 0},
+	{"h5", 0},
+	{"h6", 0},
+	{"head", 0},
+	{"hr", TAG_VOID},
+	{"html", 0},
+	{"iframe", 0},
+	{"img", TAG_VOID},
+	{"input", TAG_VOID},
+	{"ins", 0},
+	{"isindex", TAG_DEPRECATED|TAG_VOID},
+	{"i", 0},
+	{"kbd", 0},
+	{"label", 0},
+	{"legend", 0},
+	{"link", TAG_VOID},
+	{"li", 0},
+	{"map", 0},
+	{"menu", TAG_DEPRECATED},
+	{"meta", TAG_VOID},
+	{"noframes", 0},
+	{"noscript", 0},
+	{"object", 0},
+	{"ol", 0},
+	{"optgroup", 0},
+	{"option", 0},
+	{"param", TAG_VOID},
+	{"pre", 0},
+	{"p", 0},
+	{"q", 0},
+	{"samp", 0},
+	{"script", 0},
+	{"select", 0},
+	{"small", 0},
+	{"span", 0},
+	{"strike", TAG_DEPRECATED},
+	{"strong", 0},
+	{"style", 0},
+	{"sub", 0},
+	{"sup", 0},
+	{"s", TAG_DEPRECATED},
+	{"table", 0},
+	{"tbody", 0},
+	{"td", 0},
+	{"textarea", 0},
+	{"tfoot", 0},
+	{"thead", 0},
+	{"th", 0},
+	{"title", 0},
+	{"tr", 0},
+	{"tt", 0},
+	{"ul", 0},
+	{"u", TAG_DEPRECATED},
+	{"var", 0}
 };
 
-int ntags=sizeof(tags)/sizeof(char *);
+int ntags=sizeof(tags)/sizeof(tag_info);
+
+unsigned int tag_hash(const char * name, size_t len, unsigned int seed) // folds ASCII case (only), so it doesn't depend on the locale
+{
+	unsigned int h=seed;
+	size_t i;
+	for(i=0;i<len;i++)
+	{
+		unsigned char c=name[i];
+		if((c>='A')&&(c<='Z'))
+			c|=0x20;
+		h=(h^c)*16777619u;
+	}
+	h^=h>>16;
+	h*=0x7feb352du;
+	h^=h>>15;
+	return(h);
+}
+
+#ifndef MKTAGS
+#include "taghash.h" // generated by mktags: TAGHASH_SEED, TAGHASH_BITS, taghash[]
+
+int tag_lookup(const char * name, size_t len, bool icase) // returns an index into tags[], or -1 if it's not a tag
+{
+	int t=taghash[tag_hash(name, len, TAGHASH_SEED)>>(32-TAGHASH_BITS)]-1;
+	if(t<0)
+		return(-1);
+	const char *n=tags[t].name;
+	size_t i;
+	for(i=0;i<len;i++)
+	{
+		unsigned char c=name[i];
+		if(icase && (c>='A')&&(c<='Z'))
+			c|=0x20;
+		if(c!=(unsigned char)n[i])
+			return(-1);
+	}
+	return(n[len]?-1:t);
+}
+#endif
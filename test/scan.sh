@@ -0,0 +1,50 @@
+#!/bin/sh
+# scan_special(): parses stylesheets with '{', '}', '/', '*' and '\n' at every offset across a 16- and 32-byte block (and at EOF) with each build, and checks they all say the same as the first.
+# usage: test/scan.sh <cssi> [<cssi>...]; a build that's missing, or that this machine can't run (eg. AVX2 on a CPU without it), is skipped
+T=`mktemp -d`
+trap 'rm -rf "$T"' EXIT
+for b in "$@"; do BINS="$BINS `realpath $b`"; done
+cd "$T"
+awk 'BEGIN {
+	for(k=0;k<70;k++)
+	{
+		pad=sprintf("%" k "s", ""); gsub(/ /, "x", pad)
+		printf ".c%d /*%s*/ { a: b }\n", k, pad
+		printf ".d%d { a: %s; }\n", k, pad
+		printf ".e%d {%s\n%s}\n", k, pad, pad
+		printf "/*%s*%s\n*/ .f%d { a: b }\n", pad, pad, k
+		printf ".g%d { a: url(%s/y) }\n", k, pad
+		printf ".h%d {%s/*%s}*/ }\n", k, pad, pad
+		printf "/*%s\n%s/ */.i%d { a: b }\n", pad, pad, k
+	}
+}' > blocks.css
+k=0
+while [ $k -lt 70 ]; do
+	pad=`printf "%${k}s" "" | tr ' ' x`
+	printf '.z { a: b }\n.y {%s}' "$pad" > eofb$k.css # ends on the '}'
+	printf '.z { a: b }\n/*%s' "$pad" > eofc$k.css # ends in a comment
+	printf '.z {\n%s' "$pad" > eofo$k.css # ends in a block
+	k=$((k+1))
+done
+FIRST=
+FAIL=0
+for b in $BINS; do
+	echo quit | "$b" blocks.css > /dev/null 2>&1
+	if [ $? -eq 132 ] || [ ! -x "$b" ]; then # (SIGILL, or it didn't build)
+		echo "scan: skipping $b (it doesn't run here)"
+		continue
+	fi
+	for f in blocks.css eof*.css; do
+		printf 'sel\ndecl\nquit\n' | "$b" -j=1 -w=1000 "$f" 2>&1
+	done > out.txt
+	if [ -z "$FIRST" ]; then
+		FIRST=$b
+		mv out.txt first.txt
+	elif ! cmp -s out.txt first.txt; then
+		echo "scan: FAIL: $b differs from $FIRST"
+		diff first.txt out.txt | head -20
+		FAIL=1
+	fi
+done
+[ $FAIL -eq 0 ] || exit 1
+echo "scan: ok"
@@ -0,0 +1,69 @@
+#!/bin/sh
+# --watch: each case starts cssi on some files, changes them, then checks the listing it reloaded against a fresh run.
+# usage: test/watch.sh [cssi]
+CSSI=`realpath ${1:-./cssi}`
+T=`mktemp -d`
+trap 'rm -rf "$T"' EXIT
+trap '' PIPE # if it has died, say so below
+cd "$T"
+FAIL=0
+
+# watch <name> <change> <files...>: runs cssi on the files, and has <change> (a shell function) change them once it's up
+watch()
+{
+	NAME=$1
+	CHANGE=$2
+	shift 2
+	rm -f in
+	mkfifo in
+	"$CSSI" -d --watch "$@" < in > out.txt 2> err.txt &
+	PID=$!
+	exec 3> in
+	i=0
+	while [ $i -lt 60 ] && ! grep -q 'collated' err.txt; do sleep 1; i=$((i+1)); done # (stderr isn't buffered)
+	sleep 1 # for it to start watching
+	$CHANGE
+	sleep 2
+	echo sel >&3 2> /dev/null
+	echo quit >&3 2> /dev/null
+	exec 3>&-
+	wait $PID
+	RV=$?
+	printf 'sel\nquit\n' | "$CSSI" -d "$@" 2> /dev/null | sed -n '/^SEL\.\.\./,$p' > fresh.txt
+	sed -n '/^SEL\.\.\./,$p' out.txt > got.txt
+	if [ $RV -ne 0 ] || ! grep -q '^RELOAD:' out.txt || ! cmp -s got.txt fresh.txt
+	then
+		echo "watch: $NAME: FAIL (exit $RV)"
+		cat err.txt
+		FAIL=1
+	fi
+}
+
+# a changed file and one whose @imports changed, in the same batch
+printf '@import url(x.css);\n@import url(y.css);\n.m { a: b }\n' > m.css
+printf '.x { a: b }\n' > x.css
+printf '.y { a: b }\n' > y.css
+imports()
+{
+	i=0
+	while [ $i -lt 300 ]; do printf '.x%d { a: b }\n' $i; i=$((i+1)); done >> x.css # new identifiers, interned by the reload
+	printf '@import url(z.css);\n.y { a: b }\n' > y.css # so it parses everything again
+	printf '.z { a: b }\n' > z.css
+}
+watch imports imports m.css
+
+# a reload merging its selectors in among a very long one (whose sort key is bigger than a thread's stack)
+i=0
+while [ $i -lt 1000 ]; do printf 'a.b '; i=$((i+1)); done > unit.txt
+i=0
+while [ $i -lt 500 ]; do cat unit.txt; i=$((i+1)); done > long.css
+printf '{ a: b }\n' >> long.css
+printf '.s { a: b }\n' > s.css
+longsel()
+{
+	printf '.t { a: b }\n' >> s.css
+}
+watch longsel longsel long.css s.css
+
+[ $FAIL -eq 0 ] || exit 1
+echo "watch: ok"